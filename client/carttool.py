@@ -6,9 +6,11 @@
 #   or
 # pip3 install xmodem
 
-import serial, sys, logging, argparse, datetime, io, os, subprocess, time
+import serial, sys, logging, argparse, datetime, io, os, subprocess, time, struct, zlib, re
+import xml.etree.ElementTree as ET
 import serial.tools.list_ports
 from xmodem import XMODEM
+import smsrpc, smsphost
 
 verbose_mode = False
 trxbytes = 0
@@ -17,6 +19,8 @@ last_exch_start_time_start = 0
 last_exch_duration = 0
 
 programmer_caps = [ ];
+# (address, data) blocks sent by the last upload, for verifying it
+uploaded_blocks = None
 # firmware 1.0 did not have the 'version' command
 programmer_version_str = "1.0"
 # major major * 100 + minor
@@ -86,6 +90,17 @@ def readProgrammerInfo():
         if programmer_version >= 103:
             programmer_caps.append("setromsize")
 
+        # Command introduced in version 1.4
+        if programmer_version >= 104:
+            programmer_caps.append("tune")
+            programmer_caps.append("jiterase")
+            programmer_caps.append("sparseupload")
+            programmer_caps.append("sectorhash")
+            programmer_caps.append("uploadcrc")
+            programmer_caps.append("blankmap")
+            programmer_caps.append("hash")
+            programmer_caps.append("rpc")
+
 
 def download(outfile):
     print("Starting download")
@@ -102,10 +117,20 @@ def download(outfile):
 
 
 def upload(infile):
+    global uploaded_blocks
     print("Starting upload")
     time_start = datetime.datetime.now()
-    # Initiate xmodem download
-    exchangeCommand("ux", "READY. Please start uploading.\r\n", atEnd=False)
+
+    # The XMODEM module pads the last block with 0x1a
+    pos = infile.tell()
+    data = infile.read()
+    infile.seek(pos)
+    uploaded_blocks = [(addr, data[addr:addr+128].ljust(128, b'\x1a')) for addr in range(0, len(data), 128)]
+
+    # Initiate xmodem download. With uxe, sectors are erased as they are reached.
+    # The size keeps erasing ahead within the file.
+    command = "uxe %x" % len(data) if "jiterase" in programmer_caps else "ux"
+    exchangeCommand(command, "READY. Please start uploading.\r\n", atEnd=False)
 
     xm = XMODEM(getc,  putc)
     print("Uploading", end="", flush=True)
@@ -119,6 +144,274 @@ def upload(infile):
     return n
 
 
+SPARSE_BLOCK_SIZE = 128
+
+def sparseBlocks(data, size):
+    """ Return the (address, data) blocks which must be sent. Blocks which are
+    all 0xFF (the erased state) are left out, except the first and last ones, so
+    sector erasing still covers the whole file. """
+    blocks = []
+    for addr in range(0, len(data), size):
+        block = data[addr:addr+size]
+        block = block + b'\xff' * (size - len(block))
+        if block.count(0xff) != size or addr == 0 or addr + size >= len(data):
+            blocks.append((addr, block))
+    return blocks
+
+def sendSparse(blocks, command):
+    """ Send (address, data) blocks with the "us" or "use" command: XMODEM-like,
+    but the packet number is replaced by the block number. """
+    global uploaded_blocks
+    uploaded_blocks = blocks
+    exchangeCommand(command, "READY. Please start uploading.\r\n", atEnd=False)
+
+    # Wait for the NAK which starts the transfer
+    while getc(1) != b'\x15':
+        pass
+
+    print("Uploading", end="", flush=True)
+    for addr, block in blocks:
+        packet = b'\x01' + struct.pack("<H", addr // SPARSE_BLOCK_SIZE) + block + bytes([sum(block) & 0xff])
+        for retry in range(10):
+            ser.reset_input_buffer()    # Drop repeated ACKs
+            putc(packet)
+            reply = getc(1)
+            if reply == b'\x06':
+                break
+        else:
+            print("")
+            print("Upload error at address", hex(addr))
+            sendAbort()
+            return False
+
+    putc(b'\x04')
+    getc(1)
+    print("") # newline
+    return True
+
+def uploadSparse(infile):
+    """ Upload leaving out blocks of 0xFF """
+    print("Starting sparse upload")
+    time_start = datetime.datetime.now()
+    data = infile.read()
+    blocks = sparseBlocks(data, SPARSE_BLOCK_SIZE)
+    print("Sending", len(blocks), "of", (len(data) + SPARSE_BLOCK_SIZE - 1) // SPARSE_BLOCK_SIZE, "blocks")
+
+    command = "use %x" % len(data) if "jiterase" in programmer_caps else "us"
+    if not sendSparse(blocks, command):
+        return 0
+    duration = (datetime.datetime.now() - time_start).total_seconds();
+    print("Upload completed with success in ", duration, "seconds")
+    return len(data)
+
+def readSectorHashes(length):
+    """ Return (address, size, crc32) for the flash sectors covering length bytes,
+    or None if the sizes are guessed (erasing one may erase its neighbours) """
+    sectors = []
+    tmp = exchangeCommand("sh 0 %x" % length)
+    if "Sizes guessed" in tmp:
+        return None
+    for line in tmp.split("\r\n"):
+        try:
+            addr, size, crc = [int(f, 16) for f in line.split(" ")]
+            sectors.append((addr, size, crc))
+        except ValueError:
+            pass # command echo, prompt...
+    return sectors
+
+def uploadDiff(infile):
+    """ Erase and program only the sectors whose contents differ from the file """
+    global uploaded_blocks
+    print("Starting differential upload")
+    time_start = datetime.datetime.now()
+    pos = infile.tell()
+    data = infile.read()
+
+    blocks = []
+    sectors = readSectorHashes(len(data))
+    if sectors is None:
+        print("Warning: Flash sector sizes unknown (no CFI), --diff is not safe. Doing a full upload.")
+        infile.seek(pos)
+        return uploadSparse(infile)
+    changed = 0
+    for addr, size, crc in sectors:
+        # The end of the last sector is left erased
+        image = data[addr:addr+size]
+        image = image + b'\xff' * (size - len(image))
+        if zlib.crc32(image) == crc:
+            continue
+
+        changed += 1
+        exchangeCommand("se %x" % addr)
+        for block_addr, block in sparseBlocks(image, SPARSE_BLOCK_SIZE):
+            if block.count(0xff) != len(block):
+                blocks.append((addr + block_addr, block))
+
+    print(changed, "of", len(sectors), "sectors differ, sending", len(blocks), "blocks")
+    if not blocks:
+        uploaded_blocks = []
+    elif not sendSparse(blocks, "us"):
+        return 0
+
+    duration = (datetime.datetime.now() - time_start).total_seconds();
+    print("Upload completed with success in ", duration, "seconds")
+    return len(data)
+
+
+def rpcUpload(infile):
+    """ Program using binary command frames, several in flight at once """
+    global uploaded_blocks
+    time_start = datetime.datetime.now()
+    data = infile.read()
+    print("Uploading", len(data), "bytes with binary commands", end="", flush=True)
+
+    uploaded_blocks = sparseBlocks(data, smsrpc.RPC_MAX_DATA)
+    try:
+        if smsphost.available():
+            # Padded like the blocks above, for --verify
+            padding = b'\xff' * (-len(data) % smsrpc.RPC_MAX_DATA)
+            runNative(lambda prog: prog.program(data + padding, nativeProgress))
+        else:
+            rpc = smsrpc.RpcClient(ser)
+            rpc.program(uploaded_blocks, len(data), lambda addr: print(".", end="", flush=True) if addr % 16384 == 0 else None)
+    except (smsrpc.RpcError, smsphost.NativeError) as e:
+        print("")
+        print("Upload error:", e)
+        return 0
+
+    print("")
+    duration = (datetime.datetime.now() - time_start).total_seconds();
+    print("Upload completed with success in ", duration, "seconds")
+    return len(data)
+
+def rpcDownload(outfile, size):
+    """ Read using binary command frames """
+    time_start = datetime.datetime.now()
+    print("Downloading", size, "bytes with binary commands", end="", flush=True)
+
+    try:
+        if smsphost.available():
+            runNative(lambda prog: prog.dump(outfile, size, progress=nativeProgress))
+        else:
+            rpc = smsrpc.RpcClient(ser)
+            outfile.write(rpc.read(0, size))
+    except (smsrpc.RpcError, smsphost.NativeError) as e:
+        print("")
+        print("Download error:", e)
+        return 0
+
+    print("")
+    duration = (datetime.datetime.now() - time_start).total_seconds();
+    print("Bytes received:", size, "in", duration, "seconds")
+    return size
+
+def runNative(fn):
+    """ Release the serial port to the native host library (smsphost.py)
+    while fn(programmer) runs """
+    global ser
+    ser.close()
+    prog = None
+    try:
+        prog = smsphost.NativeProgrammer(args.device)
+        return fn(prog)
+    finally:
+        if prog:
+            prog.close()
+        ser = serial.Serial(args.device, 115200, 8)
+
+def nativeProgress(done, total):
+    # A dot every 16k, like the other transfers
+    if done // 16384 != (done - 1) // 16384 or done == total:
+        print(".", end="", flush=True)
+
+def verifyUploadCrcs(blocks):
+    """ Compare the CRC-32 of each sector, read back by the firmware from
+    what it programmed (crc command), with the blocks sent. """
+    if not blocks:
+        # Nothing was programmed, the table is from an earlier upload
+        return True
+
+    entries = []
+    tmp = exchangeCommand("crc")
+    if "CRC table full" in tmp:
+        return None
+    for line in tmp.split("\r\n"):
+        try:
+            addr, count, crc = [int(f, 16) for f in line.split(" ")]
+            entries.append((addr, count, crc))
+        except ValueError:
+            pass # command echo, prompt...
+
+    # Entries and blocks are both in programming order
+    i = 0
+    for addr, count, crc in entries:
+        expected = 0
+        n = 0
+        while n < count and i < len(blocks):
+            expected = zlib.crc32(blocks[i][1], expected)
+            n += len(blocks[i][1])
+            i += 1
+        if n != count or expected != crc:
+            print("Sector at", hex(addr), "differs")
+            return False
+
+    # Everything sent must have been programmed
+    return i == len(blocks)
+
+def printBlankMap(answer):
+    """ List the sectors which are not blank according to the bm command output """
+    bitmap = None
+    sectors = 0
+    for line in answer.split("\r\n"):
+        if line.startswith("Blank map: "):
+            bitmap = bytes.fromhex(line[11:])
+        elif line.startswith("Sectors: "):
+            sectors = int(line[9:])
+    if bitmap is None:
+        return
+
+    dirty = [i for i in range(sectors) if not bitmap[i // 8] & (1 << (i % 8))]
+    print(len(dirty), "of", sectors, "sectors not blank:", " ".join(str(i) for i in dirty))
+
+def readHashes():
+    """ CRC-32 of each bank and of the whole ROM (hash command).
+    Returns (list of bank CRCs, ROM size, ROM CRC) """
+    banks = []
+    size = crc = None
+    tmp = exchangeCommand("hash")
+    for line in tmp.split("\r\n"):
+        fields = line.split(" ")
+        try:
+            if fields[0] == "Image":
+                size, crc = int(fields[1], 16), int(fields[2], 16)
+            elif len(fields) == 2:
+                banks.append(int(fields[1], 16))
+        except (ValueError, IndexError):
+            pass # command echo, prompt...
+    return banks, size, crc
+
+def lookupDat(datfile, size, crc):
+    """ Find the names of the ROMs of a given size and CRC-32 in a DAT file
+    (Logiqx XML, as used by No-Intro, or ClrMamePro format) """
+    names = []
+    data = datfile.read()
+    if data.lstrip().startswith("<"):
+        for rom in ET.fromstring(data).iter("rom"):
+            if int(rom.get("size", -1)) == size and int(rom.get("crc", "0"), 16) == crc:
+                names.append(rom.get("name"))
+    else:
+        for m in re.finditer(r'rom \( name "([^"]*)" size (\d+) crc ([0-9a-fA-F]+)', data):
+            if int(m.group(2)) == size and int(m.group(3), 16) == crc:
+                names.append(m.group(1))
+    return names
+
+def getROMsize(init_answer):
+    for line in init_answer.split("\r\n"):
+        if line.startswith("ROM size set to "):
+            return int(line.split(" ")[4])
+    return None
+
+
 def downloadToBuffer():
     f = io.BytesIO()
     try:
@@ -259,7 +552,12 @@ parser.add_argument("-d", "--device", help='Use specified serial port device.',
 parser.add_argument("-l", '--listports', help='List serial ports', action='store_true')
 parser.add_argument("-v", '--verbose', help='Enable verbose output', action='store_true')
 parser.add_argument('--bootloader', help='Restart programmer in bootloader for FW update', action='store_true')
-parser.add_argument('--verify', help='Read back and compare after programming', default=False, action='store_true')
+parser.add_argument('--tune', help='Tune bus timing for the cartridge before reading', default=False, action='store_true')
+parser.add_argument('--verify', help='Verify after programming (CRC of each sector, or read back)', default=False, action='store_true')
+parser.add_argument('--diff', help='Only erase and program the flash sectors which differ from the file', default=False, action='store_true')
+parser.add_argument('--rpc', help='Read and program using binary command frames instead of XModem (through the native host library when built)', default=False, action='store_true')
+parser.add_argument('--hash', help='Compute the CRC-32 of each bank and of the whole ROM on the programmer', default=False, action='store_true')
+parser.add_argument('--dat', help='With --hash, identify the cartridge using a DAT file', type=argparse.FileType('r'), metavar='roms.dat')
 parser.add_argument('--update_firmware', help='Update programmer firmware with hexfile', action='store', metavar='firmware.hex')
 
 args = parser.parse_args()
@@ -326,8 +624,38 @@ if args.blankcheck:
     if "blankcheck" not in programmer_caps:
         print("Error: Programmer firmware does not support blank check")
         exit()
-    tmp = exchangeCommand("bc")
-    print(tmp)
+    if "blankmap" in programmer_caps:
+        tmp = exchangeCommand("bm")
+        print(tmp)
+        printBlankMap(tmp)
+    else:
+        tmp = exchangeCommand("bc")
+        print(tmp)
+
+
+# Bank and ROM CRCs, without dumping
+if args.hash:
+    if "hash" not in programmer_caps:
+        print("Error: Programmer firmware does not support hash")
+        exit()
+    sendAbort()
+    tmp = exchangeCommand("")
+    init_answer = exchangeCommand("init")
+    print(init_answer)
+    banks, size, crc = readHashes()
+    if crc is None:
+        print("Error: No hash received")
+        exit(1)
+    for i in range(len(banks)):
+        print("Bank %d: %08x" % (i, banks[i]))
+    print("ROM: %d bytes, CRC-32 %08x" % (size, crc))
+    if args.dat:
+        names = lookupDat(args.dat, size, crc)
+        if names:
+            for name in names:
+                print("Found in DAT:", name)
+        else:
+            print("Not found in DAT")
 
 
 # Download / Dump cartridge
@@ -335,9 +663,20 @@ if args.outfile != None:
     sendAbort()
     tmp = exchangeCommand("")
     tmp = exchangeCommand("")
-    tmp = exchangeCommand("init")
-    print(tmp)
-    download(args.outfile)
+    init_answer = exchangeCommand("init")
+    print(init_answer)
+    if args.tune:
+        if "tune" in programmer_caps:
+            tmp = exchangeCommand("tune")
+            print(tmp)
+        else:
+            print("Warning: Programmer firmware does not support 'tune'")
+    if args.rpc and "rpc" in programmer_caps:
+        rpcDownload(args.outfile, getROMsize(init_answer))
+    else:
+        if args.rpc:
+            print("Warning: Programmer firmware does not support --rpc")
+        download(args.outfile)
     tmp = exchangeCommand("")
 
     print("Done.")
@@ -350,14 +689,38 @@ if args.infile != None:
     tmp = exchangeCommand("")
     tmp = exchangeCommand("init")
     print(tmp)
-    tmp = exchangeCommand("ce")
-    print(tmp)
-    print("Chip erase completed in", last_exch_duration, " seconds")
-    upload(args.infile)
+    # Newer firmware erases only the sectors being programmed
+    if "jiterase" not in programmer_caps:
+        tmp = exchangeCommand("ce")
+        print(tmp)
+        print("Chip erase completed in", last_exch_duration, " seconds")
+    if args.diff and "sectorhash" in programmer_caps:
+        uploadDiff(args.infile)
+    elif args.rpc and "rpc" in programmer_caps:
+        rpcUpload(args.infile)
+    else:
+        if args.rpc:
+            print("Warning: Programmer firmware does not support --rpc")
+        if args.diff:
+            print("Warning: Programmer firmware does not support --diff")
+        if "sparseupload" in programmer_caps:
+            uploadSparse(args.infile)
+        else:
+            upload(args.infile)
     tmp = exchangeCommand("")
 
 
-    if args.verify:
+    if args.verify and "uploadcrc" in programmer_caps and uploaded_blocks is not None:
+        # No readback over USB needed, the firmware computes the CRCs
+        res = verifyUploadCrcs(uploaded_blocks)
+        if res is None:
+            print("Warning: Too many sectors for the CRC table, verify by reading back")
+        elif res:
+            print("Verify OK")
+        else:
+            print("Verify FAILED")
+            exit(1)
+    if args.verify and ("uploadcrc" not in programmer_caps or uploaded_blocks is None or res is None):
         args.infile.seek(0)
         filedata = args.infile.read()
         print("file size: ", len(filedata))
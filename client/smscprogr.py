@@ -1,5 +1,6 @@
-import serial, sys, logging, argparse
+import serial, sys, logging, argparse, struct
 from xmodem import XMODEM
+import smsphost
 
 class SMSCProgrException(Exception):
     pass
@@ -11,6 +12,7 @@ rxbytes2 = 0
 txbytes = 0
 txbytes2 = 0
 ser = None
+devpath = None
 
 progressCb = None
 
@@ -88,6 +90,89 @@ def upload(infile):
     return n
 
 
+SPARSE_BLOCK_SIZE = 128
+
+def supportsSparseUpload():
+    """ Check if the firmware has the "us" command (1.4 and later) """
+    return "    us " in exchangeCommand("?")
+
+def uploadSparse(infile):
+    """ Upload with the "us" command: XMODEM-like, but the packet number is
+    replaced by the block number so blocks of 0xFF (the erased state) can be
+    left out. The last block is always sent. """
+    global txbytes, txbytes2
+
+    txbytes = 0
+    txbytes2 = 0
+
+    print("Starting sparse upload")
+    data = infile.read()
+
+    # Initiate the upload, wait for the initial NAK character
+    exchangeCommand("us", "\x15", atEnd=True)
+
+    for addr in range(0, len(data), SPARSE_BLOCK_SIZE):
+        block = data[addr:addr+SPARSE_BLOCK_SIZE]
+        block = block + b'\xff' * (SPARSE_BLOCK_SIZE - len(block))
+        if block.count(0xff) == SPARSE_BLOCK_SIZE and addr + SPARSE_BLOCK_SIZE < len(data):
+            continue
+
+        packet = b'\x01' + struct.pack("<H", addr // SPARSE_BLOCK_SIZE) + block + bytes([sum(block) & 0xff])
+        for retry in range(10):
+            ser.reset_input_buffer()    # Drop repeated ACKs
+            putc(packet)
+            if getc(1, timeout=1) == b'\x06':
+                break
+        else:
+            sendAbort()
+            raise SMSCProgrException("Upload error at address 0x%06x" % addr)
+
+    putc(b'\x04')
+    getc(1, timeout=1)
+    print("Upload completed with success.")
+    return len(data)
+
+
+def useNative():
+    """ The native host library (smsphost.py) talks to the programmer with
+    binary command frames, introduced in 1.4 along with "us" """
+    return smsphost.available() and supportsSparseUpload()
+
+def runNative(fn):
+    """ Release the serial port to the native library while fn(programmer) runs """
+    global ser
+    ser.close()
+    prog = None
+    try:
+        prog = smsphost.NativeProgrammer(devpath)
+        return fn(prog)
+    except smsphost.NativeError as e:
+        raise SMSCProgrException(str(e))
+    finally:
+        if prog:
+            prog.close()
+        ser = serial.Serial(devpath, 115200, 8)
+
+def nativeProgress(done, total):
+    if progressCb:
+        progressCb(done)
+
+def nativeUpload(infile):
+    print("Starting upload (native)")
+    data = infile.read()
+    runNative(lambda prog: prog.program(data, nativeProgress))
+    print("Upload completed with success.")
+    return len(data)
+
+def nativeDownload(outfile):
+    print("Starting download (native)")
+    def dump(prog):
+        size = prog.info()["rom_size"]
+        prog.dump(outfile, size, progress=nativeProgress)
+        return size
+    n = runNative(dump)
+    print("Bytes received: " + str(n))
+    return n
 
 
 # Glue functions for xmodem
@@ -124,7 +209,8 @@ def putc(data, timeout=0.1):
 
 
 def open(device):
-    global ser
+    global ser, devpath
+    devpath = device
     try:
         ser = serial.Serial(device, 115200, 8)
     except Exception as e:
@@ -203,7 +289,12 @@ def eraseAndProgram(infile):
     tmp = exchangeCommand("ce")
     print(tmp)
 
-    upload(infile)
+    if useNative():
+        nativeUpload(infile)
+    elif supportsSparseUpload():
+        uploadSparse(infile)
+    else:
+        upload(infile)
     exchangeCommand("")
 
     return True
@@ -224,7 +315,12 @@ def program(infile):
     if progressCb:
         progressCb(-1)
 
-    upload(infile)
+    if useNative():
+        nativeUpload(infile)
+    elif supportsSparseUpload():
+        uploadSparse(infile)
+    else:
+        upload(infile)
     exchangeCommand("")
 
     return True
@@ -240,7 +336,10 @@ def readROM(outfile):
 
 #    "ROM size set to <size>"
 
-    download(outfile)
+    if useNative():
+        nativeDownload(outfile)
+    else:
+        download(outfile)
 
     return True
 
@@ -0,0 +1,116 @@
+# Python bindings for the native host library (host/, see
+# host/include/smscprogr/smscprogr.h), loaded with ctypes.
+#
+# The library is searched in $SMSCPROGR_LIB, host/build and the system
+# library path. available() tells if it was found.
+
+import ctypes, ctypes.util, os, shutil, tempfile
+
+class NativeError(Exception):
+    pass
+
+class SmspInfo(ctypes.Structure):
+    _fields_ = [ ("rom_size", ctypes.c_uint32),
+                 ("flash_size", ctypes.c_uint32),
+                 ("mapper_type", ctypes.c_uint8) ]
+
+PROGRESS_CB = ctypes.CFUNCTYPE(None, ctypes.c_uint64, ctypes.c_uint64, ctypes.c_void_p)
+
+_lib = None
+
+def _candidates():
+    if "SMSCPROGR_LIB" in os.environ:
+        yield os.environ["SMSCPROGR_LIB"]
+    yield os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "host", "build", "libsmscprogr.so")
+    name = ctypes.util.find_library("smscprogr")
+    if name:
+        yield name
+
+def _load():
+    global _lib
+    if _lib:
+        return _lib
+    for path in _candidates():
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+
+        lib.smsp_open.restype = ctypes.c_void_p
+        lib.smsp_open.argtypes = [ ctypes.c_char_p ]
+        lib.smsp_close.argtypes = [ ctypes.c_void_p ]
+        lib.smsp_last_error.restype = ctypes.c_char_p
+        lib.smsp_last_error.argtypes = [ ctypes.c_void_p ]
+        lib.smsp_set_window.argtypes = [ ctypes.c_void_p, ctypes.c_uint ]
+        lib.smsp_command.argtypes = [ ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t ]
+        lib.smsp_get_info.argtypes = [ ctypes.c_void_p, ctypes.POINTER(SmspInfo) ]
+        lib.smsp_erase_sector.argtypes = [ ctypes.c_void_p, ctypes.c_uint32 ]
+        lib.smsp_dump_fd.argtypes = [ ctypes.c_void_p, ctypes.c_int, ctypes.c_uint32, ctypes.c_uint32, PROGRESS_CB, ctypes.c_void_p ]
+        lib.smsp_program.argtypes = [ ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, PROGRESS_CB, ctypes.c_void_p ]
+        _lib = lib
+        return lib
+    return None
+
+def available():
+    return _load() is not None
+
+def _progressCb(progress):
+    # Keep a reference while the call runs
+    if progress:
+        return PROGRESS_CB(lambda done, total, user: progress(done, total))
+    return ctypes.cast(None, PROGRESS_CB)
+
+class NativeProgrammer:
+    """ Drives the programmer with binary command frames (see firmware/rpc.h),
+    with several requests in flight. progress callbacks receive (done, total). """
+
+    def __init__(self, device):
+        self.lib = _load()
+        if not self.lib:
+            raise NativeError("Native library not found")
+        self.h = self.lib.smsp_open(device.encode())
+        if not self.h:
+            raise NativeError(self.lib.smsp_last_error(None).decode())
+
+    def close(self):
+        if self.h:
+            self.lib.smsp_close(self.h)
+            self.h = None
+
+    def _check(self, res):
+        if res < 0:
+            raise NativeError(self.lib.smsp_last_error(self.h).decode())
+        return res
+
+    def setWindow(self, window):
+        self.lib.smsp_set_window(self.h, window)
+
+    def command(self, line):
+        out = ctypes.create_string_buffer(4096)
+        n = self._check(self.lib.smsp_command(self.h, line.encode("ascii"), out, len(out)))
+        return out.raw[:n].decode("ascii", "ignore")
+
+    def info(self):
+        info = SmspInfo()
+        self._check(self.lib.smsp_get_info(self.h, ctypes.byref(info)))
+        return { "rom_size": info.rom_size, "flash_size": info.flash_size, "mapper_type": info.mapper_type }
+
+    def eraseSector(self, addr):
+        self._check(self.lib.smsp_erase_sector(self.h, addr))
+
+    def dump(self, outfile, size, addr=0, progress=None):
+        """ Dump straight to the file descriptor of outfile, or through a
+        temporary file for in-memory files (io.BytesIO) """
+        try:
+            fd = outfile.fileno()
+        except (AttributeError, OSError):
+            with tempfile.TemporaryFile() as tmp:
+                self.dump(tmp, size, addr, progress)
+                tmp.seek(0)
+                shutil.copyfileobj(tmp, outfile)
+            return
+        outfile.flush()
+        self._check(self.lib.smsp_dump_fd(self.h, fd, addr, size, _progressCb(progress), None))
+
+    def program(self, data, progress=None):
+        self._check(self.lib.smsp_program(self.h, data, len(data), _progressCb(progress), None))
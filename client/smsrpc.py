@@ -0,0 +1,121 @@
+# Binary command frames for smscprogr (see firmware/rpc.h)
+#
+# Requests are sent without waiting for the previous replies (up to a
+# window), and the replies are matched by request ID.
+#
+# apt install python3-serial
+
+import binascii, struct
+
+# Must match firmware/rpc.h
+RPC_SYNC = 0xa5
+RPC_REPLY_SYNC = 0xa6
+RPC_MAX_DATA = 64
+
+RPC_OP_PING = 0x00
+RPC_OP_COMMAND = 0x01
+RPC_OP_INFO = 0x02
+RPC_OP_READ = 0x03
+RPC_OP_PROGRAM = 0x04
+RPC_OP_ERASE_SECTOR = 0x05
+RPC_OP_PROGRAM_BEGIN = 0x06
+
+RPC_STATUS_OK = 0x00
+RPC_STATUS_MORE = 0x01
+
+STATUS_NAMES = { 0x80: "bad CRC", 0x81: "unknown opcode", 0x82: "bad arguments", 0x83: "command not allowed in a frame" }
+
+class RpcError(Exception):
+    pass
+
+def crc16(data):
+    # CRC-16 XMODEM, as _crc_xmodem_update() in the firmware
+    return binascii.crc_hqx(data, 0)
+
+class RpcClient:
+    def __init__(self, ser, window=4, timeout=10):
+        self.ser = ser
+        self.window = window
+        self.timeout = timeout
+        self.next_id = 0
+        self.in_flight = []
+        self.replies = {}
+
+    def send(self, op, payload=b""):
+        """ Send a request and return its ID, without waiting for the reply """
+        req_id = self.next_id
+        self.next_id = (self.next_id + 1) & 0xff
+        body = bytes([op, req_id, len(payload)]) + payload
+        self.ser.write(bytes([RPC_SYNC]) + body + struct.pack("<H", crc16(body)))
+        self.in_flight.append(req_id)
+        return req_id
+
+    def receiveFrame(self):
+        """ Read one reply frame, skipping text which may precede it.
+        Returns (opcode, request ID, status, payload) """
+        self.ser.timeout = self.timeout
+        while True:
+            b = self.ser.read(1)
+            if not b:
+                raise RpcError("Timeout waiting for a reply")
+            if b[0] == RPC_REPLY_SYNC:
+                break
+
+        hdr = self.ser.read(4)
+        if len(hdr) < 4:
+            raise RpcError("Truncated reply")
+        payload = self.ser.read(hdr[3])
+        crc = self.ser.read(2)
+        if len(payload) < hdr[3] or len(crc) < 2:
+            raise RpcError("Truncated reply")
+        if struct.unpack("<H", crc)[0] != crc16(hdr + payload):
+            raise RpcError("Bad reply CRC")
+        return hdr[0], hdr[1], hdr[2], payload
+
+    def wait(self, req_id):
+        """ Collect the replies to a request. Returns the data of all of them. """
+        while req_id not in self.replies or self.replies[req_id][0] == RPC_STATUS_MORE:
+            op, rid, status, payload = self.receiveFrame()
+            data = self.replies[rid][1] if rid in self.replies else b""
+            self.replies[rid] = (status, data + payload)
+
+        status, data = self.replies.pop(req_id)
+        self.in_flight.remove(req_id)
+        if status != RPC_STATUS_OK:
+            raise RpcError("Request failed: " + STATUS_NAMES.get(status, hex(status)))
+        return data
+
+    def call(self, op, payload=b""):
+        return self.wait(self.send(op, payload))
+
+    def ping(self):
+        """ Returns (protocol version, firmware version BCD) """
+        return struct.unpack("<BH", self.call(RPC_OP_PING))
+
+    def command(self, line):
+        """ Run a text command and return its output """
+        return self.call(RPC_OP_COMMAND, line.encode("ascii")).decode("ascii", "ignore")
+
+    def info(self):
+        rom_size, flash_size, mapper_type = struct.unpack("<IIB", self.call(RPC_OP_INFO))
+        return { "rom_size": rom_size, "flash_size": flash_size, "mapper_type": mapper_type }
+
+    def read(self, addr, length):
+        return self.call(RPC_OP_READ, struct.pack("<II", addr, length))
+
+    def eraseSector(self, addr):
+        self.call(RPC_OP_ERASE_SECTOR, struct.pack("<I", addr))
+
+    def program(self, blocks, size, progress=None):
+        """ Program (address, data) blocks of up to RPC_MAX_DATA bytes, keeping
+        up to window requests in flight. size is the image size: Sectors past
+        it are not erased. """
+        pending = [ self.send(RPC_OP_PROGRAM_BEGIN, struct.pack("<I", size)) ]
+        for addr, data in blocks:
+            if len(pending) >= self.window:
+                self.wait(pending.pop(0))
+            pending.append(self.send(RPC_OP_PROGRAM, struct.pack("<I", addr) + data))
+            if progress:
+                progress(addr)
+        for req_id in pending:
+            self.wait(req_id)
@@ -0,0 +1,135 @@
+#!/usr/bin/python3
+
+# Fetch the firmware event trace ("trace" command) and print it as a timeline.
+#
+# apt install python3-serial
+
+import serial, sys, argparse, struct
+
+# Must match firmware/trace.h
+TRACE_FORMAT_VERSION = 2
+TIME_BITS = 20
+US_PER_UNIT = 4     # 64 cycles at 16 MHz
+
+XMODEM_STATES = { 0: "WAIT_SOH", 1: "RX_DATA", 2: "PROCESS_PACKET" }
+
+def fmtXmodemState(arg):
+    return "%s packet %d" % (XMODEM_STATES.get(arg & 0xff, "?%d" % (arg & 0xff)), arg >> 8)
+
+def fmtSlot(arg):
+    return "slot %d -> bank %d" % (arg >> 8, arg & 0xff)
+
+def fmtUsbTx(arg):
+    return "EP%d, %d bytes" % (arg >> 8, arg & 0xff)
+
+EVENTS = {
+    1: ("xmodem state", fmtXmodemState),
+    2: ("xmodem block", lambda a: "packet %d sent" % a),
+    3: ("xmodem ack", lambda a: "packet %d" % a),
+    4: ("xmodem nak", lambda a: "packet %d" % a),
+    5: ("mapper", fmtSlot),
+    6: ("flash program", lambda a: "at 0x%04x" % a),
+    7: ("flash erase", lambda a: "chip" if a == 0xffff else "sector at 0x%06x" % (a * 8192)),
+    8: ("flash done", lambda a: "%d bytes" % a if a else ""),
+    9: ("usb tx", fmtUsbTx),
+    10: ("rx highwater", lambda a: "%d bytes buffered" % a),
+    11: ("rx full", lambda a: "%d byte packet held" % a),
+}
+
+def readDump(ser):
+    """ Send the trace command and return the binary dump """
+    ser.reset_input_buffer()
+    ser.write(b"trace\r\n")
+    ser.flush()
+    ser.timeout = 2
+
+    # Skip the echo until the magic
+    data = b""
+    while not data.endswith(b"TRC"):
+        b = ser.read(1)
+        if not b:
+            raise Exception("No trace received (firmware too old?)")
+        data = data + b
+
+    hdr = ser.read(6)
+    count, size = hdr[1], hdr[2]
+    return b"TRC" + hdr + ser.read(count * size)
+
+def decode(dump):
+    if dump[0:3] != b"TRC":
+        raise Exception("Not a trace dump")
+    if dump[3] != TRACE_FORMAT_VERSION:
+        raise Exception("Unsupported trace format %d" % dump[3])
+
+    count, size = dump[4], dump[5]
+    if not size:
+        raise Exception("The firmware was built without the trace (make TRACE=1)")
+    now = int.from_bytes(dump[6:9], "little")
+    records = []
+    pos = 9
+    for i in range(count):
+        t = int.from_bytes(dump[pos:pos+3], "little")
+        event, t = t >> TIME_BITS, t & ((1 << TIME_BITS) - 1)
+        arg, = struct.unpack("<H", dump[pos+3:pos+5])
+        records.append((t, event, arg))
+        pos = pos + size
+
+    # Unwrap the timestamps. Gaps longer than the wrap period cannot
+    # be detected.
+    wrap = 1 << TIME_BITS
+    timeline = []
+    offset = 0
+    last = None
+    for t, event, arg in records:
+        if last is not None and t < last:
+            offset = offset + wrap
+        last = t
+        timeline.append((t + offset, event, arg))
+
+    if last is not None and now < last:
+        offset = offset + wrap
+    return timeline, now + offset
+
+def printTimeline(timeline, now):
+    if not timeline:
+        print("Trace is empty")
+        return
+
+    start = timeline[0][0]
+    prev = start
+    print("%12s %10s  %-14s %s" % ("time (us)", "delta", "event", "details"))
+    for t, event, arg in timeline:
+        name, fmt = EVENTS.get(event, ("event %d" % event, lambda a: "0x%04x" % a))
+        print("%12d %10d  %-14s %s" % ((t - start) * US_PER_UNIT, (t - prev) * US_PER_UNIT, name, fmt(arg)))
+        prev = t
+
+    print("%12d %10d  %-14s" % ((now - start) * US_PER_UNIT, (now - prev) * US_PER_UNIT, "(dump)"))
+
+
+parser = argparse.ArgumentParser(description='Decode the smscprogr event trace')
+parser.add_argument("-d", "--device", help='Use specified serial port device.', action='store', default='/dev/ttyACM0')
+parser.add_argument("-f", "--file", help='Decode a dump saved with --save instead of reading the programmer', type=argparse.FileType('rb'))
+parser.add_argument("-s", "--save", help='Save the binary dump to a file', type=argparse.FileType('wb'))
+parser.add_argument("-c", "--clear", help='Clear the trace after reading it', action='store_true')
+args = parser.parse_args()
+
+if args.file:
+    dump = args.file.read()
+else:
+    try:
+        ser = serial.Serial(args.device, 115200, 8)
+    except Exception as e:
+        print(e)
+        print("Could not open serial port")
+        exit(1)
+
+    dump = readDump(ser)
+    if args.clear:
+        ser.write(b"trace clear\r\n")
+        ser.flush()
+
+if args.save:
+    args.save.write(dump)
+
+timeline, now = decode(dump)
+printTimeline(timeline, now)
@@ -19,10 +19,12 @@
 #include <avr/wdt.h>
 #include <util/delay.h>
 #include "usb.h"
+#include "timer.h"
 
 void enterBootLoader(void)
 {
 	cli();
+	timer_shutdown();
 	usb_shutdown();
 	_delay_ms(10);
 
@@ -47,6 +49,7 @@ void enterBootLoader(void)
 
 void resetFirmware(void)
 {
+	timer_shutdown();
 	usb_shutdown();
 
 	// jump to the application reset vector
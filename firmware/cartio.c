@@ -18,10 +18,18 @@
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <stdio.h>
+#include <string.h>
+#include "cartio.h"
+#include "stats.h"
+
+/* When defined, cartReadSequential() uses a hand-scheduled assembly
+ * kernel for aligned runs of 16 bytes. Comment out to compare with
+ * the C implementation. Both follow the current timing profile. */
+#define CARTIO_ASM_READ
 
 #define CPLD_SET_LE() PORTC |= 0x80
 #define CPLD_CLR_LE() PORTC &= 0x7F
-#define CPLD_PULSE_LE() do { CPLD_SET_LE(); _delay_us(0.5); CPLD_CLR_LE(); _delay_us(1); } while(0)
+#define CPLD_PULSE_LE() do { CPLD_SET_LE(); CART_DLY(s_timing.le); CPLD_CLR_LE(); CART_DLY(s_timing.settle); } while(0)
 
 #define CE_LOW()	PORTC &= ~0x20
 #define CE_HIGH()	PORTC |= 0x20
@@ -38,57 +46,117 @@
 #define FLOAT_DATA() DDRB = 0
 #define DRIVE_DATA() DDRB = 0xff
 
-#define WR_DLY()	_delay_us(0.5)
-#define RD_DLY()	_delay_us(0.5)
+/* Delays are in _delay_loop_1 units (3 cycles, 187.5ns). Zero means
+ * no delay at all (_delay_loop_1(0) would loop 256 times) */
+#define CART_DLY(n)	do { if (n) _delay_loop_1(n); } while(0)
+
+#define WR_DLY()	CART_DLY(s_timing.wr)
+#define RD_DLY()	CART_DLY(s_timing.rd)
+
+#define CLK_DLY()	CART_DLY(s_timing.clk)
 
-#define CLK_DLY()	_delay_us(0.5)
+static const struct cartio_timing timing_profiles[] PROGMEM = {
+	[CARTIO_TIMING_FAST] = { .le = 0, .settle = 0, .rd = 1, .wr = 1, .clk = 1 },
+	[CARTIO_TIMING_ROM] = { .le = 1, .settle = 1, .rd = 2, .wr = 2, .clk = 2 },
+	// Equivalent to the original 0.5us strobes and 1us settle time.
+	[CARTIO_TIMING_SAFE] = { .le = 3, .settle = 6, .rd = 3, .wr = 3, .clk = 3 },
+};
+
+static struct cartio_timing s_timing = { .le = 3, .settle = 6, .rd = 3, .wr = 3, .clk = 3 };
+static uint8_t s_timing_profile = CARTIO_TIMING_SAFE;
 
 static uint8_t s_first = 1;
 static uint16_t s_cur_address;
 
-static void setCartAddress(uint16_t addr)
+void cartio_setTimingProfile(uint8_t profile)
+{
+	if (profile >= CARTIO_NUM_TIMING_PROFILES)
+		return;
+
+	memcpy_P(&s_timing, &timing_profiles[profile], sizeof(struct cartio_timing));
+	s_timing_profile = profile;
+}
+
+uint8_t cartio_getTimingProfile(void)
+{
+	return s_timing_profile;
+}
+
+void cartio_getTiming(struct cartio_timing *dst)
+{
+	memcpy(dst, &s_timing, sizeof(struct cartio_timing));
+}
+
+void cartio_setTiming(const struct cartio_timing *timing)
+{
+	memcpy(&s_timing, timing, sizeof(struct cartio_timing));
+	s_timing_profile = CARTIO_TIMING_CUSTOM;
+}
+
+/* Latch the address in the CPLD. Only the nibbles which differ from
+ * what the CPLD currently holds (s_cur_address) are pulsed. For sequential
+ * accesses, this is usually only the low nibble. */
+static void latchAddress(uint16_t addr)
 {
-	uint8_t nib;
+	uint16_t changed;
 
 	if (s_first) {
 		s_first = 0;
-	} else if (addr == s_cur_address) {
-		_delay_us(5);
-		return;
+		changed = 0xFFFF;
+	} else {
+		changed = addr ^ s_cur_address;
 	}
 
-	// Save what will be the new address before
-	// addr gets modified!
 	s_cur_address = addr;
 
-	nib = addr & 0xf;
-	addr >>= 4;
-	PORTD &= ~0x3F;
-	PORTD |= 0x00 | nib;
-	CPLD_PULSE_LE();
-
-	nib = addr & 0xf;
-	addr >>= 4;
-	PORTD &= ~0x3F;
-	PORTD |= 0x10 | nib;
-	CPLD_PULSE_LE();
-
-	nib = addr & 0xf;
-	addr >>= 4;
-	PORTD &= ~0x3F;
-	PORTD |= 0x20 | nib;
-	CPLD_PULSE_LE();
-
-	nib = addr & 0xf;
-	PORTD &= ~0x3F;
-	PORTD |= 0x30 | nib;
-	CPLD_PULSE_LE();
+	if (changed & 0x000F) {
+		PORTD &= ~0x3F;
+		PORTD |= 0x00 | (addr & 0xf);
+		CPLD_PULSE_LE();
+	}
+
+	if (changed & 0x00F0) {
+		PORTD &= ~0x3F;
+		PORTD |= 0x10 | ((addr >> 4) & 0xf);
+		CPLD_PULSE_LE();
+	}
+
+	if (changed & 0x0F00) {
+		PORTD &= ~0x3F;
+		PORTD |= 0x20 | ((addr >> 8) & 0xf);
+		CPLD_PULSE_LE();
+	}
+
+	if (changed & 0xF000) {
+		PORTD &= ~0x3F;
+		PORTD |= 0x30 | (addr >> 12);
+		CPLD_PULSE_LE();
+	}
+}
+
+void setCartAddress(uint16_t addr)
+{
+	uint8_t phase;
+
+	phase = stats_phaseBegin(STATS_PH_ADDR_LATCH);
+
+	if (!s_first && addr == s_cur_address) {
+		_delay_us(5);
+	} else {
+		latchAddress(addr);
+	}
 
+	stats_phaseEnd(phase);
 }
 
 void cartWrite(uint16_t addr, uint8_t b)
 {
+	uint8_t phase;
+
 	setCartAddress(addr);
+
+	phase = stats_phaseBegin(STATS_PH_BUS_WRITE);
+
 	SET_DATA(b);
 	DRIVE_DATA();
 
@@ -104,11 +172,17 @@ void cartWrite(uint16_t addr, uint8_t b)
 	SET_DATA(0xff);
 	FLOAT_DATA();
 
+	stats_phaseEnd(phase);
 }
 
 void cartWriteClk(uint16_t addr, uint8_t b)
 {
+	uint8_t phase;
+
 	setCartAddress(addr);
+
+	phase = stats_phaseBegin(STATS_PH_BUS_WRITE);
+
 	SET_DATA(b);
 	DRIVE_DATA();
 
@@ -126,15 +200,20 @@ void cartWriteClk(uint16_t addr, uint8_t b)
 	// Make sure internal pull-ups are ON
 	SET_DATA(0xff);
 	FLOAT_DATA();
+
+	stats_phaseEnd(phase);
 }
 
 
 uint8_t cartRead(uint16_t addr)
 {
 	uint8_t b;
+	uint8_t phase;
 
 	setCartAddress(addr);
 
+	phase = stats_phaseBegin(STATS_PH_BUS_READ);
+
 	// Leave pins as input
 	FLOAT_DATA();
 	// Make sure internal pull-ups are ON
@@ -149,14 +228,118 @@ uint8_t cartRead(uint16_t addr)
 	RD_HIGH();
 	CE_HIGH();
 
+	stats_phaseEnd(phase);
+
 	return b;
 }
 
-void cartReadBytes(uint16_t startaddr, uint16_t length, uint8_t *dst)
+#ifdef CARTIO_ASM_READ
+/* Read the 16 bytes at the address currently latched in the CPLD, with
+ * the low nibble going from 0 to 15. The three upper nibbles must already
+ * be latched and the data bus must be floating.
+ *
+ * Each delay loop below lasts 3*n+2 cycles (62.5ns per cycle), with n taken
+ * from the current timing profile:
+ *
+ *   out PORTD (nibble)         1
+ *   LE high                    2
+ *   delay (le)                 3*le+2
+ *   LE low                     2
+ *   delay (settle)             3*settle+2
+ *   CE low, RD low             4
+ *   delay (rd)                 3*rd+2
+ *   in PINB                    1
+ *   RD high, CE high           4
+ *   st, inc, dec, brne         6
+ */
+static void cartRead16(uint8_t *dst)
 {
+	uint8_t nib, tmp, cnt, dly;
+
+	asm volatile(
+		"in %[nib], %[portd]		\n"
+		"andi %[nib], 0xC0			\n" // keep PD6/PD7, select the A0-A3 register
+		"ldi %[cnt], 16				\n"
+		"1:							\n"
+		"out %[portd], %[nib]		\n"
+		"sbi %[portc], 7			\n" // LE high
+		"mov %[dly], %[le]			\n"
+		"2: subi %[dly], 1			\n"
+		"brcc 2b					\n"
+		"cbi %[portc], 7			\n" // LE low
+		"mov %[dly], %[settle]		\n"
+		"3: subi %[dly], 1			\n"
+		"brcc 3b					\n"
+		"cbi %[portc], 5			\n" // CE low
+		"cbi %[portc], 2			\n" // RD low
+		"mov %[dly], %[rd]			\n"
+		"4: subi %[dly], 1			\n"
+		"brcc 4b					\n"
+		"in %[tmp], %[pinb]			\n"
+		"sbi %[portc], 2			\n" // RD high
+		"sbi %[portc], 5			\n" // CE high
+		"st %a[dst]+, %[tmp]		\n"
+		"inc %[nib]					\n"
+		"dec %[cnt]					\n"
+		"brne 1b					\n"
+		: [nib] "=&d" (nib), [tmp] "=&r" (tmp), [cnt] "=&d" (cnt), [dly] "=&d" (dly),
+		  [dst] "+e" (dst)
+		: [portd] "I" (_SFR_IO_ADDR(PORTD)),
+		  [portc] "I" (_SFR_IO_ADDR(PORTC)),
+		  [pinb] "I" (_SFR_IO_ADDR(PINB)),
+		  [le] "r" (s_timing.le),
+		  [settle] "r" (s_timing.settle),
+		  [rd] "r" (s_timing.rd)
+		: "memory"
+	);
+}
+#endif
+
+void cartReadSequential(uint16_t startaddr, uint16_t length, uint8_t *dst)
+{
+	uint8_t phase;
+
+	phase = stats_phaseBegin(STATS_PH_BUS_READ);
+
+	// Leave pins as input
+	FLOAT_DATA();
+	// Make sure internal pull-ups are ON
+	SET_DATA(0xff);
+
 	while (length--) {
-		*dst = cartRead(startaddr);
+#ifdef CARTIO_ASM_READ
+		if (!(startaddr & 0xf) && length >= 15) {
+			latchAddress(startaddr);
+			cartRead16(dst);
+
+			// The kernel leaves 0xF in the low nibble register
+			s_cur_address = startaddr | 0xf;
+
+			dst += 16;
+			startaddr += 16;
+			length -= 15;
+			continue;
+		}
+#endif
+		latchAddress(startaddr);
+
+		CE_LOW();
+		RD_LOW();
+
+		RD_DLY();
+		*dst = GET_DATA();
+
+		RD_HIGH();
+		CE_HIGH();
+
 		dst++;
 		startaddr++;
 	}
+
+	stats_phaseEnd(phase);
+}
+
+void cartReadBytes(uint16_t startaddr, uint16_t length, uint8_t *dst)
+{
+	cartReadSequential(startaddr, length, dst);
 }
@@ -1,6 +1,31 @@
 #ifndef _cartio_h__
 #define _cartio_h__
 
+#include <stdint.h>
+
+/* Bus timing. All values are in delay loop units of 3 cycles (187.5ns).
+ * See cartio.c for how each one affects a bus cycle. */
+struct cartio_timing {
+	uint8_t le;		// CPLD latch enable pulse width
+	uint8_t settle;	// address settle time after latching
+	uint8_t rd;		// read strobe, before sampling data
+	uint8_t wr;		// write strobe
+	uint8_t clk;	// mapper clock half-period
+};
+
+enum {
+	CARTIO_TIMING_FAST = 0,	// fast (70-90ns) flash
+	CARTIO_TIMING_ROM,		// standard mask ROM
+	CARTIO_TIMING_SAFE,		// conservative, works with everything (default)
+	CARTIO_NUM_TIMING_PROFILES,
+	CARTIO_TIMING_CUSTOM = 0xff,	// set through cartio_setTiming()
+};
+
+void cartio_setTimingProfile(uint8_t profile);
+uint8_t cartio_getTimingProfile(void);
+void cartio_getTiming(struct cartio_timing *dst);
+void cartio_setTiming(const struct cartio_timing *timing);
+
 void setCartAddress(uint16_t addr);
 uint8_t cartRead(uint16_t addr);
 void cartWrite(uint16_t addr, uint8_t b);
@@ -8,5 +33,9 @@ void cartWriteClk(uint16_t addr, uint8_t b);
 
 void cartReadBytes(uint16_t startaddr, uint16_t length, uint8_t *dst);
 
+/* Burst read of consecutive addresses. Only the address nibbles that
+ * change between bytes are latched. */
+void cartReadSequential(uint16_t startaddr, uint16_t length, uint8_t *dst);
+
 #endif // _cartio_h__
 
@@ -0,0 +1,159 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "cartio.h"
+#include "mapper.h"
+#include "cfi.h"
+
+#define CFI_BASE	0x8000
+
+// CFI table offsets (in words for x16 parts, bytes for x8 parts)
+#define CFI_QRY				0x10
+#define CFI_CMDSET			0x13
+#define CFI_PRI_ADDR		0x15
+#define CFI_PROGRAM_TYP		0x1F
+#define CFI_ERASE_TYP		0x21
+#define CFI_CHIP_TYP		0x22
+#define CFI_PROGRAM_MAX		0x23
+#define CFI_ERASE_MAX		0x25
+#define CFI_CHIP_MAX		0x26
+#define CFI_SIZE			0x27
+#define CFI_NUM_REGIONS		0x2C
+#define CFI_REGIONS			0x2D
+
+// AMD primary extended table, relative to CFI_PRI_ADDR
+#define PRI_ERASE_SUSPEND	0x06
+#define PRI_SIMULTANEOUS	0x0A
+#define PRI_BOOT			0x0F
+
+static uint8_t s_width;
+
+static uint8_t cfiRead(uint8_t offset)
+{
+	return cartRead(CFI_BASE + offset * s_width);
+}
+
+static uint16_t cfiRead16(uint8_t offset)
+{
+	return cfiRead(offset) | (cfiRead(offset + 1) << 8);
+}
+
+static uint8_t hasSignature(uint8_t offset, char a, char b, char c)
+{
+	return cfiRead(offset) == a && cfiRead(offset + 1) == b && cfiRead(offset + 2) == c;
+}
+
+static void readAmdExtended(struct cfi_info *info)
+{
+	uint16_t pri = cfiRead16(CFI_PRI_ADDR);
+	struct cfi_region tmp;
+	uint8_t i, n;
+
+	// The table must be in the slot 2 window
+	if (!pri || pri > 0x1FFF / s_width || !hasSignature(pri, 'P', 'R', 'I'))
+		return;
+
+	if (cfiRead(pri + PRI_ERASE_SUSPEND) == 2) {
+		info->flags |= CFI_FLAG_ERASE_SUSPEND;
+	}
+	if (cfiRead(pri + PRI_SIMULTANEOUS)) {
+		info->flags |= CFI_FLAG_SIMULTANEOUS;
+	}
+	if (cfiRead(pri + PRI_BOOT) == 3) {
+		info->flags |= CFI_FLAG_TOP_BOOT;
+
+		// Some top boot parts list their regions from the top
+		n = info->num_regions;
+		if (n > 1 && info->regions[0].size < info->regions[n-1].size) {
+			for (i=0; i<n/2; i++) {
+				tmp = info->regions[i];
+				info->regions[i] = info->regions[n-1-i];
+				info->regions[n-1-i] = tmp;
+			}
+		}
+	}
+}
+
+uint8_t cfi_query(struct cfi_info *info)
+{
+	uint8_t i;
+
+	memset(info, 0, sizeof(struct cfi_info));
+
+	mapper_setSlot(SLOT2, 0);
+
+	// Try a x16 part in byte mode (as on the 29LV320), then a x8 part.
+	for (s_width = 2; s_width; s_width--) {
+		cartWrite(CFI_BASE + 0x55 * s_width, 0x98);
+		if (hasSignature(CFI_QRY, 'Q', 'R', 'Y')) {
+			break;
+		}
+		cartWrite(CFI_BASE, 0xF0);
+	}
+
+	if (s_width) {
+		info->width = s_width;
+		info->size_exp = cfiRead(CFI_SIZE);
+		info->program_typ = cfiRead(CFI_PROGRAM_TYP);
+		info->program_max = cfiRead(CFI_PROGRAM_MAX);
+		info->erase_typ = cfiRead(CFI_ERASE_TYP);
+		info->erase_max = cfiRead(CFI_ERASE_MAX);
+		info->chip_typ = cfiRead(CFI_CHIP_TYP);
+		info->chip_max = cfiRead(CFI_CHIP_MAX);
+
+		info->num_regions = cfiRead(CFI_NUM_REGIONS);
+		if (info->num_regions > CFI_MAX_REGIONS) {
+			info->num_regions = CFI_MAX_REGIONS;
+		}
+		for (i=0; i<info->num_regions; i++) {
+			info->regions[i].count = cfiRead16(CFI_REGIONS + i * 4) + 1;
+			info->regions[i].size = cfiRead16(CFI_REGIONS + i * 4 + 2);
+		}
+
+		if (cfiRead16(CFI_CMDSET) == 0x0002) {
+			// There is no CFI field for it, but parts using this command
+			// set all implement Unlock Bypass.
+			info->flags |= CFI_FLAG_AMD_CMDSET | CFI_FLAG_UNLOCK_BYPASS;
+			readAmdExtended(info);
+		}
+
+		// Back to read mode
+		cartWrite(CFI_BASE, 0xF0);
+	}
+
+	mapper_setSlot(SLOT2, 2);
+
+	return info->width;
+}
+
+uint32_t cfi_blockSize(const struct cfi_info *info, uint32_t rom_addr)
+{
+	uint32_t addr = 0, size, region_len;
+	uint8_t i;
+
+	for (i=0; i<info->num_regions; i++) {
+		size = info->regions[i].size ? (uint32_t)info->regions[i].size << 8 : 128;
+		region_len = size * info->regions[i].count;
+		if (rom_addr < addr + region_len) {
+			return size;
+		}
+		addr += region_len;
+	}
+
+	return 0;
+}
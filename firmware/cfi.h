@@ -0,0 +1,40 @@
+#ifndef _cfi_h__
+#define _cfi_h__
+
+#include <stdint.h>
+
+/* Common Flash Interface query. Times are kept as the exponents found in
+ * the CFI table to save RAM. */
+
+#define CFI_MAX_REGIONS		4
+
+#define CFI_FLAG_AMD_CMDSET		0x01 // AMD/Fujitsu command set (0x0002)
+#define CFI_FLAG_UNLOCK_BYPASS	0x02 // Assumed for the AMD command set
+#define CFI_FLAG_ERASE_SUSPEND	0x04 // Programming while an erase is suspended
+#define CFI_FLAG_SIMULTANEOUS	0x08 // Read in a bank while another is busy
+#define CFI_FLAG_TOP_BOOT		0x10
+
+struct cfi_region {
+	uint16_t count;		// Number of blocks
+	uint16_t size;		// Block size / 256 (0 means 128 bytes)
+};
+
+struct cfi_info {
+	uint8_t width;		// 0: no CFI, 1: x8 part, 2: x16 part in byte mode
+	uint8_t size_exp;	// Device size is 2^n bytes
+	uint8_t num_regions;
+	struct cfi_region regions[CFI_MAX_REGIONS]; // From the lowest address
+	uint8_t program_typ, program_max;	// Byte program: 2^n us, max is typ * 2^n
+	uint8_t erase_typ, erase_max;		// Block erase: 2^n ms, max is typ * 2^n
+	uint8_t chip_typ, chip_max;			// Chip erase: 2^n ms, max is typ * 2^n (0: n/a)
+	uint8_t flags;
+};
+
+/* Query the chip through the slot 2 window (slot 2 is left on bank 2).
+ * Returns info->width, 0 if the chip does not answer. */
+uint8_t cfi_query(struct cfi_info *info);
+
+/* Size of the erase block holding rom_addr, 0 if outside the chip */
+uint32_t cfi_blockSize(const struct cfi_info *info, uint32_t rom_addr);
+
+#endif // _cfi_h__
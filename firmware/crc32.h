@@ -0,0 +1,10 @@
+#ifndef _crc32_h__
+#define _crc32_h__
+
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3, as used by zlib and zip). Start with crc = 0 and
+ * pass the previous result to continue over more data. */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint16_t len);
+
+#endif // _crc32_h__
@@ -15,10 +15,112 @@
  *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdint.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
 #include "cartio.h"
+#include "cfi.h"
+#include "crc32.h"
 #include "flash.h"
+#include "mapper.h"
+#include "stats.h"
+#include "trace.h"
 
-static struct flashops *ops = &flash_29f040_ops;
+// The driver tables are in program memory
+static const struct flashops *ops = &flash_29f040_ops;
+#define OPS_FN(fn)	((__typeof__(ops->fn))pgm_read_word(&ops->fn))
+static struct cfi_info s_cfi;
+
+/* When defined, programmed ranges are noted for a CRC-32 per sector
+ * (see flash_crcBegin()) */
+#define FLASH_PROGRAM_CRC
+
+/* Ranges programmed since flash_crcBegin(), in order. Only the ranges
+ * are kept (SRAM is scarce, EEPROM too slow to write while programming),
+ * the CRCs are computed from the flash when the table is read. */
+#define CRC_RUNS	8
+
+struct crc_run {
+	uint32_t start;
+	uint32_t end;
+};
+
+static struct crc_run s_crc_runs[CRC_RUNS];
+static uint8_t s_crc_runs_used;
+static uint8_t s_crc_count;
+static uint8_t s_crc_enabled;
+
+// Image size of the upload, sectors past it are not erased ahead
+static uint32_t s_jit_limit;
+// Sectors below this address were erased or found blank
+static uint32_t s_jit_next;
+// Same, for sectors of the next bank prepared ahead (none when equal)
+static uint32_t s_ahead_start, s_ahead_next;
+// Sector being erased in the background (multi-bank parts)
+static uint32_t s_bg_addr;
+static uint8_t s_bg_busy;
+
+/* The exact geometry when the chip has CFI, the driver's otherwise */
+static uint32_t sectorSize(uint32_t rom_addr)
+{
+	uint32_t size = 0;
+
+	if (s_cfi.width) {
+		size = cfi_blockSize(&s_cfi, rom_addr);
+	}
+	if (!size) {
+		size = OPS_FN(sectorSize)(rom_addr);
+	}
+
+	return size;
+}
+
+/* Background erase operations go through slot 1, as slot 2 is used
+ * for programming. mapper_readRom() expects bank 1 there, so call
+ * bgRelease() when done. */
+static uint16_t bgCartAddr(void)
+{
+	mapper_setSlot(SLOT1, s_bg_addr >> 14);
+	return 0x4000 | (s_bg_addr & 0x3FFF);
+}
+
+static void bgRelease(void)
+{
+	mapper_invalidateSlots();
+	mapper_setSlot(SLOT1, 1);
+}
+
+static void bgErasePoll(uint8_t wait)
+{
+	uint16_t cartAddr;
+	uint8_t phase;
+
+	if (!s_bg_busy)
+		return;
+
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+	cartAddr = bgCartAddr();
+	do {
+		if (OPS_FN(sectorEraseDone)(cartAddr)) {
+			s_bg_busy = 0;
+			trace_add(TRACE_EV_FLASH_DONE, 0);
+		}
+	} while (wait && s_bg_busy);
+	bgRelease();
+	stats_phaseEnd(phase);
+}
+
+/* The bank being erased can neither be read nor programmed */
+static void waitBank(uint32_t rom_addr)
+{
+	if (s_bg_busy && OPS_FN(bankEnd)(rom_addr) == OPS_FN(bankEnd)(s_bg_addr)) {
+		bgErasePoll(1);
+	}
+}
+
+void flash_waitIdle(void)
+{
+	bgErasePoll(1);
+}
 
 void flash_init(void)
 {
@@ -26,42 +128,355 @@ void flash_init(void)
 
 	ops = &flash_29f040_ops;
 
-	id = flash_29lv320_ops.readSiliconID();
-	if (id == 0xa7c2) {
-		ops = &flash_29lv320_ops;
-	}
-	if (id == 0x5001) {
-		ops = &flash_29lv320_ops;
+	id = ((uint16_t (*)(void))pgm_read_word(&flash_29lv320_ops.readSiliconID))();
+	cfi_query(&s_cfi);
+
+	switch (id)
+	{
+		case 0xa7c2: ops = &flash_29lv320_ops; break;
+		case 0x5001: ops = &flash_s29jl032_ops; break;
+		case 0xa4c2: break;
+		default:
+			// Unknown chips using the AMD command set are supported through CFI
+			if (s_cfi.flags & CFI_FLAG_AMD_CMDSET) {
+				ops = s_cfi.width == 2 ? &flash_29lv320_ops : &flash_29f040_ops;
+			}
+			break;
 	}
+
+	mapper_invalidateSlots();
+}
+
+const struct cfi_info *flash_getCfi(void)
+{
+	return &s_cfi;
+}
+
+uint8_t flash_sectorSizesKnown(void)
+{
+	return s_cfi.width || !pgm_read_byte(&ops->sizes_guessed);
+}
+
+uint8_t flash_hasUnlockBypass(void)
+{
+	return !s_cfi.width || (s_cfi.flags & CFI_FLAG_UNLOCK_BYPASS);
 }
 
 uint16_t flash_readSiliconID(void)
 {
-	return ops->readSiliconID();
+	uint16_t id = OPS_FN(readSiliconID)();
+
+	mapper_invalidateSlots();
+	return id;
 }
 
 char flash_detect(void)
 {
-	return ops->detect();
+	char res = OPS_FN(detect)();
+
+	mapper_invalidateSlots();
+	return res;
 }
 
 void flash_chipErase(void)
 {
-	ops->chipErase();
+	flash_waitIdle();
+	trace_add(TRACE_EV_FLASH_ERASE, 0xFFFF);
+	OPS_FN(chipErase)();
+	mapper_invalidateSlots();
+	trace_add(TRACE_EV_FLASH_DONE, 0);
 }
 
 void flash_programBytes(uint16_t cartAddr, uint8_t *data, int len)
 {
-	ops->programBytes(cartAddr, data, len);
+	trace_add(TRACE_EV_FLASH_PROGRAM, cartAddr);
+	OPS_FN(programBytes)(cartAddr, data, len);
+	mapper_invalidateSlots();
+	trace_add(TRACE_EV_FLASH_DONE, len);
 }
 
 void flash_programByte(uint16_t cartAddr, uint8_t b)
 {
-	ops->programByte(cartAddr, b);
+	trace_add(TRACE_EV_FLASH_PROGRAM, cartAddr);
+	OPS_FN(programByte)(cartAddr, b);
+	mapper_invalidateSlots();
+	trace_add(TRACE_EV_FLASH_DONE, 1);
+}
+
+static void crcCountEntry(void)
+{
+	if (s_crc_count < 255) {
+		s_crc_count++;
+	}
+}
+
+/* Note a programmed range. An entry is counted for each range, and each
+ * time a range continues into the next sector. */
+static void crcUpdate(uint32_t rom_addr, uint8_t len)
+{
+	struct crc_run *run;
+	uint32_t mask;
+
+	if (!s_crc_enabled)
+		return;
+
+	run = &s_crc_runs[s_crc_runs_used ? s_crc_runs_used - 1 : 0];
+	if (s_crc_runs_used && rom_addr == run->end) {
+		mask = ~(sectorSize(rom_addr) - 1);
+		if ((rom_addr & mask) != ((rom_addr - 1) & mask)) {
+			crcCountEntry();
+		}
+		run->end += len;
+		return;
+	}
+
+	crcCountEntry();
+	if (s_crc_runs_used >= CRC_RUNS) {
+		// Table full, the count now exceeds what flash_crcGet() returns
+		s_crc_enabled = 0;
+		return;
+	}
+
+	run = &s_crc_runs[s_crc_runs_used++];
+	run->start = rom_addr;
+	run->end = rom_addr + len;
+}
+
+void flash_crcBegin(void)
+{
+	s_crc_runs_used = 0;
+	s_crc_count = 0;
+	s_crc_enabled = 1;
+}
+
+void flash_crcEnd(void)
+{
+	s_crc_enabled = 0;
+}
+
+uint8_t flash_crcCount(void)
+{
+	return s_crc_count;
+}
+
+uint8_t flash_crcGet(uint8_t i, uint32_t *rom_addr, uint32_t *count, uint32_t *crc)
+{
+	uint8_t buf[32];
+	struct crc_run *run;
+	uint32_t addr, end, size;
+	uint8_t r, n;
+
+	// Find the part of a range which is entry i
+	for (r=0; r<s_crc_runs_used; r++) {
+		run = &s_crc_runs[r];
+		for (addr = run->start; addr < run->end; addr = end) {
+			size = sectorSize(addr);
+			end = (addr & ~(size - 1)) + size;
+			if (end > run->end) {
+				end = run->end;
+			}
+			if (i--)
+				continue;
+
+			*rom_addr = addr & ~(size - 1);
+			*count = end - addr;
+			*crc = 0;
+
+			waitBank(addr);
+			for (; addr < end; addr += n) {
+				n = end - addr < sizeof(buf) ? end - addr : sizeof(buf);
+				mapper_readRom(addr, n, buf);
+				*crc = crc32_update(*crc, buf, n);
+			}
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Program at a linear ROM address, through slot 2. The range must
+ * not cross a 16K bank boundary. */
+void flash_programRom(uint32_t rom_addr, const uint8_t *data, uint8_t len)
+{
+	uint8_t suspend;
+
+	stats_count(STATS_CNT_BYTES_PROGRAMMED, len);
+
+	// Any erase left is in another bank. Pause it meanwhile, unless the
+	// chip can work on both banks at once.
+	waitBank(rom_addr);
+	suspend = s_bg_busy && !(s_cfi.flags & CFI_FLAG_SIMULTANEOUS);
+	if (suspend) {
+		OPS_FN(eraseSuspend)(bgCartAddr());
+		bgRelease();
+	}
+
+	mapper_setSlot(SLOT2, rom_addr >> 14);
+	flash_programBytes(0x8000 | (rom_addr & 0x3FFF), (uint8_t*)data, len);
+#ifdef FLASH_PROGRAM_CRC
+	crcUpdate(rom_addr, len);
+#endif
+
+	if (suspend) {
+		OPS_FN(eraseResume)(bgCartAddr());
+		bgRelease();
+	}
+}
+
+uint32_t flash_getSectorSize(uint32_t rom_addr)
+{
+	return sectorSize(rom_addr);
+}
+
+void flash_eraseSector(uint32_t rom_addr)
+{
+	rom_addr &= ~(sectorSize(rom_addr) - 1);
+
+	// One erase at a time
+	flash_waitIdle();
+
+	trace_add(TRACE_EV_FLASH_ERASE, rom_addr >> 13);
+	mapper_setSlot(SLOT2, rom_addr >> 14);
+	OPS_FN(sectorErase)(0x8000 | (rom_addr & 0x3FFF));
+	mapper_invalidateSlots();
+	trace_add(TRACE_EV_FLASH_DONE, 0);
+}
+
+uint32_t flash_hashSector(uint32_t rom_addr)
+{
+	uint8_t buf[32];
+	uint32_t size = sectorSize(rom_addr);
+	uint32_t crc = 0;
+
+	rom_addr &= ~(size - 1);
+	waitBank(rom_addr);
+
+	for (; size; rom_addr += sizeof(buf), size -= sizeof(buf)) {
+		mapper_readRom(rom_addr, sizeof(buf), buf);
+		crc = crc32_update(crc, buf, sizeof(buf));
+	}
+
+	return crc;
+}
+
+/* Stops at the first byte which is not 0xFF, its address is stored
+ * in *dirty_addr if not NULL. */
+static uint8_t romRangeIsBlank(uint32_t rom_addr, uint32_t len, uint32_t *dirty_addr)
+{
+	uint8_t buf[32];
+	uint8_t i;
+
+	waitBank(rom_addr);
+
+	for (; len; rom_addr += sizeof(buf), len -= sizeof(buf)) {
+		mapper_readRom(rom_addr, sizeof(buf), buf);
+		for (i=0; i<sizeof(buf); i++) {
+			if (buf[i] != 0xff) {
+				if (dirty_addr) {
+					*dirty_addr = rom_addr + i;
+				}
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+uint8_t flash_sectorIsBlank(uint32_t rom_addr, uint32_t *dirty_addr)
+{
+	uint32_t size = sectorSize(rom_addr);
+
+	return romRangeIsBlank(rom_addr & ~(size - 1), size, dirty_addr);
+}
+
+void flash_jitEraseReset(uint32_t image_size)
+{
+	flash_waitIdle();
+	s_jit_limit = image_size;
+	s_jit_next = 0;
+	s_ahead_start = s_ahead_next = 0;
+}
+
+/* Prepare the next sector of the bank following the one holding rom_addr,
+ * if the part supports it and no erase is in progress. */
+static void eraseAhead(uint32_t rom_addr)
+{
+	uint32_t next_bank, size;
+
+	if (!OPS_FN(sectorEraseStart))
+		return;
+	if (s_cfi.width && !(s_cfi.flags & CFI_FLAG_ERASE_SUSPEND))
+		return;
+
+	bgErasePoll(0);
+	if (s_bg_busy)
+		return;
+
+	next_bank = OPS_FN(bankEnd)(rom_addr);
+	if (s_ahead_start != next_bank) {
+		s_ahead_start = s_ahead_next = next_bank;
+	}
+
+	// Only one bank ahead, not past the end of the chip or the image
+	if (s_ahead_next >= OPS_FN(bankEnd)(s_ahead_start))
+		return;
+	if (s_ahead_next >= s_jit_limit)
+		return;
+
+	size = sectorSize(s_ahead_next);
+	if (!romRangeIsBlank(s_ahead_next, size, NULL)) {
+		trace_add(TRACE_EV_FLASH_ERASE, s_ahead_next >> 13);
+		s_bg_addr = s_ahead_next;
+		OPS_FN(sectorEraseStart)(bgCartAddr());
+		bgRelease();
+		s_bg_busy = 1;
+	}
+	s_ahead_next += size;
+}
+
+void flash_programRomJit(uint32_t rom_addr, const uint8_t *data, uint8_t len)
+{
+	uint32_t addr = rom_addr, end = rom_addr + len;
+	uint32_t size;
+
+	// Sectors skipped over by a sparse upload must be erased too
+	if (s_jit_next < addr) {
+		addr = s_jit_next;
+	}
+
+	while (addr < end) {
+		size = sectorSize(addr);
+		addr &= ~(size - 1);
+
+		if (addr == s_ahead_start && s_ahead_next != s_ahead_start) {
+			// Reached the sectors prepared ahead
+			s_jit_next = s_ahead_next;
+			s_ahead_start = s_ahead_next = 0;
+		}
+
+		if (addr + size > s_jit_next) {
+			if (!romRangeIsBlank(addr, size, NULL)) {
+				flash_eraseSector(addr);
+			}
+			s_jit_next = addr + size;
+		}
+
+		addr += size;
+	}
+
+	flash_programRom(rom_addr, data, len);
+	eraseAhead(rom_addr);
 }
 
 uint32_t flash_getMaxSize(uint16_t flash_id)
 {
+	if (s_cfi.width) {
+		return 1UL << s_cfi.size_exp;
+	}
+
 	switch(flash_id)
 	{
 		case 0xa4c2: return 524288; // MX29F040     512K
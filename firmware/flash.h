@@ -7,20 +7,88 @@ struct flashops {
 	void (*chipErase)(void);
 	void (*programBytes)(uint16_t cartAddr, uint8_t *data, int len);
 	void (*programByte)(uint16_t cartAddr, uint8_t b);
+	// Erase the sector at cartAddr (blocking)
+	void (*sectorErase)(uint16_t cartAddr);
+	// Size of the sector holding rom_addr. Sectors are aligned to their size.
+	uint32_t (*sectorSize)(uint32_t rom_addr);
+	// Non-zero if sectorSize() guesses (boot sector position unknown)
+	uint8_t sizes_guessed;
+
+	// Optional, for parts which can erase a sector in one bank while another
+	// bank is read or programmed (NULL otherwise).
+
+	// End of the bank holding rom_addr (0 past the end of the chip)
+	uint32_t (*bankEnd)(uint32_t rom_addr);
+	// Start erasing the sector at cartAddr and return immediately
+	void (*sectorEraseStart)(uint16_t cartAddr);
+	// Non-zero once the erase started at cartAddr is over
+	uint8_t (*sectorEraseDone)(uint16_t cartAddr);
+	// Suspend/resume the erase in progress at cartAddr, to program elsewhere
+	// (not needed when CFI reports simultaneous operation)
+	void (*eraseSuspend)(uint16_t cartAddr);
+	void (*eraseResume)(uint16_t cartAddr);
 };
 
+struct cfi_info;
+
 uint16_t flash_readSiliconID(void);
+/* Identify the chip (silicon ID, then CFI for unknown chips) */
 void flash_init(void);
+/* CFI information read by flash_init() (width is 0 if unavailable) */
+const struct cfi_info *flash_getCfi(void);
+/* Zero when flash_getSectorSize() may be smaller than what the chip
+ * really erases (no CFI, boot sectors at an unknown end) */
+uint8_t flash_sectorSizesKnown(void);
+/* For drivers: Unlock Bypass may be used (true unless CFI says otherwise) */
+uint8_t flash_hasUnlockBypass(void);
 char flash_detect(void);
 void flash_chipErase(void);
 void flash_programBytes(uint16_t cartAddr, uint8_t *data, int len);
 void flash_programByte(uint16_t cartAddr, uint8_t b);
+void flash_programRom(uint32_t rom_addr, const uint8_t *data, uint8_t len);
+
+uint32_t flash_getSectorSize(uint32_t rom_addr);
+/* Erase the sector holding rom_addr */
+void flash_eraseSector(uint32_t rom_addr);
+/* CRC-32 of the sector holding rom_addr */
+uint32_t flash_hashSector(uint32_t rom_addr);
+/* Check if the sector holding rom_addr is all 0xFF. If not, returns 0 and
+ * stores the address of the first other byte in *dirty_addr (if not NULL). */
+uint8_t flash_sectorIsBlank(uint32_t rom_addr, uint32_t *dirty_addr);
+
+/* Per-sector CRC-32 of the programmed data. Between flash_crcBegin() and
+ * flash_crcEnd(), flash_programRom() notes the ranges it programs. Each
+ * entry (ROM address of the sector, bytes programmed, CRC) is the part of
+ * a range within one sector, its CRC is read back from the flash by
+ * flash_crcGet(). Used to verify uploads without a full readback. */
+void flash_crcBegin(void);
+void flash_crcEnd(void);
+/* Number of sectors programmed, can exceed what the table holds */
+uint8_t flash_crcCount(void);
+/* Get table entry i. Returns 0 if not available. */
+uint8_t flash_crcGet(uint8_t i, uint32_t *rom_addr, uint32_t *count, uint32_t *crc);
+
+/* Just-in-time erase: flash_programRomJit() erases each sector when it is
+ * first written to, unless it is already blank. Writes must be in
+ * ascending order, apart from rewriting what was already written.
+ * Call flash_jitEraseReset() before each upload.
+ *
+ * On multi-bank parts, the sectors of the next bank are erased in the
+ * background while the current bank is programmed, up to image_size.
+ * Nothing is erased ahead when image_size is 0 (unknown). */
+void flash_jitEraseReset(uint32_t image_size);
+void flash_programRomJit(uint32_t rom_addr, const uint8_t *data, uint8_t len);
+/* Wait for background erasing started by flash_programRomJit() to end. Call
+ * at the end of an upload, before the cartridge is accessed otherwise. */
+void flash_waitIdle(void);
 
-// based on a known flash ID, return the size of the chip
+// return the size of the chip, from CFI or based on a known flash ID
 uint32_t flash_getMaxSize(uint16_t flash_id);
 
-extern struct flashops flash_29f040_ops;
-extern struct flashops flash_29lv320_ops;
+// In program memory
+extern const struct flashops flash_29f040_ops;
+extern const struct flashops flash_29lv320_ops;
+extern const struct flashops flash_s29jl032_ops;
 
 #endif // _flash_h__
 
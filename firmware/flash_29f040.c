@@ -15,8 +15,10 @@
  *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdint.h>
+#include <avr/pgmspace.h>
 #include "cartio.h"
 #include "flash.h"
+#include "stats.h"
 
 static uint16_t readSiliconID(void)
 {
@@ -51,6 +53,8 @@ static char detect(void)
 
 static void chipErase(void)
 {
+	uint8_t phase;
+
 	// Step 1: Write AA to address 555
 	cartWrite(0x0555, 0xAA);
 	// Step 2: Write 55 to address 2AA
@@ -64,15 +68,64 @@ static void chipErase(void)
 	// Step 3: Write 10 to address 555
 	cartWrite(0x0555, 0x10);
 
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
 	while (!(cartRead(0x0000) & 0x80)) {
 	}
+	stats_phaseEnd(phase);
 
 	cartWrite(0x0000, 0xF0);
 }
 
+static void sectorErase(uint16_t cartAddr)
+{
+	uint8_t phase, b;
+
+	// Step 1: Write AA to address 555
+	cartWrite(0x0555, 0xAA);
+	// Step 2: Write 55 to address 2AA
+	cartWrite(0x02AA, 0x55);
+	// Step 3: Write 80 to address 555
+	cartWrite(0x0555, 0x80);
+	// Step 4: Write AA to address 555
+	cartWrite(0x0555, 0xAA);
+	// Step 5: Write 55 to address 2AA
+	cartWrite(0x02AA, 0x55);
+	// Step 6: Write 30 to the sector address
+	cartWrite(cartAddr, 0x30);
+
+	// DQ7 reads 0 until the erase completes
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+	do {
+		b = cartRead(cartAddr);
+		if (!(b & 0x80) && (b & 0x20)) {
+			// DQ5: Exceeded timing limits
+			if (!(cartRead(cartAddr) & 0x80)) {
+				cartWrite(0x0000, 0xF0);
+				break;
+			}
+		}
+	} while (!(b & 0x80));
+	stats_phaseEnd(phase);
+}
+
+// 8 uniform 64K sectors
+static uint32_t sectorSize(uint32_t rom_addr)
+{
+	return 0x10000;
+}
+
 static void programBytes(uint16_t cartAddr, uint8_t *data, int len)
 {
+	uint8_t phase;
+
 	while (len--) {
+		// 0xFF is the erased state, nothing to program
+		if (*data == 0xFF) {
+			cartAddr++;
+			data++;
+			continue;
+		}
+
 		// Step 1: Write AA to address 555
 		cartWrite(0x0555, 0xAA);
 		// Step 2: Write 55 to address 2AA
@@ -84,7 +137,9 @@ static void programBytes(uint16_t cartAddr, uint8_t *data, int len)
 
 		// Now poll Q7 for completion. Q7 is the complement
 		// of what was written until completion.
+		phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
 		while ((cartRead(cartAddr)&0x80) != ((*data)&0x80));
+		stats_phaseEnd(phase);
 
 		cartAddr++;
 		data++;
@@ -96,11 +151,13 @@ static void programByte(uint16_t cartAddr, uint8_t b)
 	programBytes(cartAddr, &b, 1);
 }
 
-struct flashops flash_29f040_ops = {
+const struct flashops flash_29f040_ops PROGMEM = {
 	.readSiliconID = readSiliconID,
 	.detect = detect,
 	.chipErase = chipErase,
 	.programBytes = programBytes,
 	.programByte = programByte,
+	.sectorErase = sectorErase,
+	.sectorSize = sectorSize,
 };
 
@@ -15,8 +15,10 @@
  *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdint.h>
+#include <avr/pgmspace.h>
 #include "cartio.h"
 #include "flash.h"
+#include "stats.h"
 
 static uint16_t readSiliconID(void)
 {
@@ -50,6 +52,8 @@ static char detect(void)
 
 static void chipErase(void)
 {
+	uint8_t phase;
+
 	cartWrite(0xAAA, 0xAA);
 	cartWrite(0x555, 0x55);
 	cartWrite(0xAAA, 0x80);
@@ -58,40 +62,185 @@ static void chipErase(void)
 	// Step 3: Write 10 to address 555
 	cartWrite(0xAAA, 0x10);
 
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
 	while (!(cartRead(0x0000) & 0x80)) {
 	}
+	stats_phaseEnd(phase);
 
 	cartWrite(0x0000, 0xF0);
 }
 
-static void programBytes(uint16_t cartAddr, uint8_t *data, int len)
+static void sectorErase(uint16_t cartAddr)
+{
+	uint8_t phase, b;
+
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(0xAAA, 0x80);
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(cartAddr, 0x30);
+
+	// DQ7 reads 0 until the erase completes
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+	do {
+		b = cartRead(cartAddr);
+		if (!(b & 0x80) && (b & 0x20)) {
+			// DQ5: Exceeded timing limits
+			if (!(cartRead(cartAddr) & 0x80)) {
+				cartWrite(0x0000, 0xF0);
+				break;
+			}
+		}
+	} while (!(b & 0x80));
+	stats_phaseEnd(phase);
+}
+
+/* 64K sectors, except for eight 8K boot sectors at the top (T models) or
+ * bottom (B models) of the 4MB chip. Both ends are reported as 8K sectors:
+ * on a chip with a 64K sector there, erasing the first 8K erases all of it
+ * and the rest is then found blank (see flash_programRomJit()). Erasing a
+ * single sector there may erase more than reported (see sizes_guessed). */
+static uint32_t sectorSize(uint32_t rom_addr)
 {
+	if (rom_addr < 0x10000 || rom_addr >= 0x3F0000) {
+		return 0x2000;
+	}
+
+	return 0x10000;
+}
+
+/* When defined, programBytes() enters Unlock Bypass mode once per call
+ * (unless CFI says the chip lacks it), after which each byte only takes a
+ * 2-cycle program command instead of the full unlock sequence. Comment out
+ * to compare. */
+#define FLASH_UNLOCK_BYPASS
+
+/* Wait for the end of a program operation using DQ7 (the complement of
+ * the data written until completion). Returns 0 on success, -1 if the
+ * chip reports a failure (DQ5, exceeded timing limits). */
+static int8_t waitProgram(uint16_t cartAddr, uint8_t data)
+{
+	uint8_t b;
+
+	while (1) {
+		b = cartRead(cartAddr);
+		if ((b & 0x80) == (data & 0x80))
+			return 0;
+
+		if (b & 0x20) {
+			// DQ7 may have changed at the same time as DQ5
+			b = cartRead(cartAddr);
+			if ((b & 0x80) == (data & 0x80))
+				return 0;
+			return -1;
+		}
+	}
+}
+
+#ifdef FLASH_UNLOCK_BYPASS
+static void programBytesBypass(uint16_t cartAddr, uint8_t *data, int len)
+{
+	uint16_t start = cartAddr;
+	uint8_t phase;
+	int8_t res;
+
+	// Enter Unlock Bypass
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(0xAAA, 0x20);
+
+	while (len--) {
+		// 0xFF is the erased state, nothing to program
+		if (*data == 0xFF) {
+			cartAddr++;
+			data++;
+			continue;
+		}
+
+		// The first cycle accepts any address. Use one that differs from
+		// the previous and the target address in the low nibble only, since
+		// repeating an address costs a delay in setCartAddress().
+		cartWrite((cartAddr & 0xFFF0) | ((cartAddr + 8) & 0x000F), 0xA0);
+		cartWrite(cartAddr, *data);
+
+		phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+		res = waitProgram(cartAddr, *data);
+		stats_phaseEnd(phase);
+
+		if (res) {
+			// Reset to leave the error state (back to Unlock Bypass)
+			cartWrite(cartAddr, 0xF0);
+			break;
+		}
+
+		cartAddr++;
+		data++;
+	}
+
+	// Unlock Bypass Reset. cartAddr may now be past the end of the slot.
+	cartWrite(start, 0x90);
+	cartWrite(start, 0x00);
+}
+#endif
+
+static void programBytesStandard(uint16_t cartAddr, uint8_t *data, int len)
+{
+	uint8_t phase;
+	int8_t res;
+
 	while (len--) {
+		// 0xFF is the erased state, nothing to program
+		if (*data == 0xFF) {
+			cartAddr++;
+			data++;
+			continue;
+		}
+
 		cartWrite(0xAAA, 0xAA);
 		cartWrite(0x555, 0x55);
 		cartWrite(0xAAA, 0xA0);
 
 		cartWrite(cartAddr, *data);
 
-		// Now poll Q7 for completion. Q7 is the complement
-		// of what was written until completion.
-		while ((cartRead(cartAddr)&0x80) != ((*data)&0x80));
+		phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+		res = waitProgram(cartAddr, *data);
+		stats_phaseEnd(phase);
+
+		if (res) {
+			cartWrite(0x0000, 0xF0);
+			break;
+		}
 
 		cartAddr++;
 		data++;
 	}
 }
 
+static void programBytes(uint16_t cartAddr, uint8_t *data, int len)
+{
+#ifdef FLASH_UNLOCK_BYPASS
+	if (flash_hasUnlockBypass()) {
+		programBytesBypass(cartAddr, data, len);
+		return;
+	}
+#endif
+	programBytesStandard(cartAddr, data, len);
+}
+
 static void programByte(uint16_t cartAddr, uint8_t b)
 {
 	programBytes(cartAddr, &b, 1);
 }
 
-struct flashops flash_29lv320_ops = {
+const struct flashops flash_29lv320_ops PROGMEM = {
 	.readSiliconID = readSiliconID,
 	.detect = detect,
 	.chipErase = chipErase,
 	.programBytes = programBytes,
 	.programByte = programByte,
+	.sectorErase = sectorErase,
+	.sectorSize = sectorSize,
+	.sizes_guessed = 1,
 };
 
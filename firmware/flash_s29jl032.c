@@ -0,0 +1,268 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <avr/pgmspace.h>
+#include "cartio.h"
+#include "flash.h"
+#include "stats.h"
+
+/* S29JL032 : Same command set as the 29LV320 (byte mode), but the array is
+ * split in four banks. A bank can be read while another one is erasing, and
+ * an erase can be suspended to program elsewhere. flash.c uses this to erase
+ * the sectors of the next bank in the background (see flash_programRomJit()).
+ *
+ * Bank 1: 0x000000 - 0x07FFFF (4 Mbit)
+ * Bank 2: 0x080000 - 0x1FFFFF (12 Mbit)
+ * Bank 3: 0x200000 - 0x37FFFF (12 Mbit)
+ * Bank 4: 0x380000 - 0x3FFFFF (4 Mbit)
+ */
+
+// Set while an erase is suspended. Unlock Bypass is not used then.
+static uint8_t s_suspended;
+
+static uint16_t readSiliconID(void)
+{
+	uint16_t id;
+
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+
+	cartWrite(0xAAA, 0x90);
+	id = cartRead(0x0000);
+	id |= cartRead(0x0002) << 8;
+
+	// Reset
+	cartWrite(0x0000, 0xF0);
+
+	return id;
+}
+
+static char detect(void)
+{
+	uint16_t mem, id;
+
+	mem = cartRead(0x0000);
+	mem |= cartRead(0x0002) << 8;
+
+	id = readSiliconID();
+
+	return id != mem;
+}
+
+static void chipErase(void)
+{
+	uint8_t phase;
+
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(0xAAA, 0x80);
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(0xAAA, 0x10);
+
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+	while (!(cartRead(0x0000) & 0x80)) {
+	}
+	stats_phaseEnd(phase);
+
+	cartWrite(0x0000, 0xF0);
+}
+
+static void sectorEraseStart(uint16_t cartAddr)
+{
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(0xAAA, 0x80);
+	cartWrite(0xAAA, 0xAA);
+	cartWrite(0x555, 0x55);
+	cartWrite(cartAddr, 0x30);
+}
+
+static uint8_t sectorEraseDone(uint16_t cartAddr)
+{
+	uint8_t b;
+
+	// DQ7 reads 0 until the erase completes
+	b = cartRead(cartAddr);
+	if (b & 0x80) {
+		return 1;
+	}
+
+	if (b & 0x20) {
+		// DQ5: Exceeded timing limits
+		if (!(cartRead(cartAddr) & 0x80)) {
+			cartWrite(cartAddr, 0xF0);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static void sectorErase(uint16_t cartAddr)
+{
+	uint8_t phase;
+
+	sectorEraseStart(cartAddr);
+
+	phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+	while (!sectorEraseDone(cartAddr)) {
+	}
+	stats_phaseEnd(phase);
+}
+
+static void eraseSuspend(uint16_t cartAddr)
+{
+	uint8_t a, b;
+
+	cartWrite(cartAddr, 0xB0);
+
+	// DQ6 stops toggling once suspended (or if the erase had completed)
+	b = cartRead(cartAddr);
+	do {
+		a = b;
+		b = cartRead(cartAddr);
+	} while ((a ^ b) & 0x40);
+
+	s_suspended = 1;
+}
+
+static void eraseResume(uint16_t cartAddr)
+{
+	// Ignored if the erase had already completed
+	cartWrite(cartAddr, 0x30);
+	s_suspended = 0;
+}
+
+static uint32_t bankEnd(uint32_t rom_addr)
+{
+	if (rom_addr < 0x080000)
+		return 0x080000;
+	if (rom_addr < 0x200000)
+		return 0x200000;
+	if (rom_addr < 0x380000)
+		return 0x380000;
+	if (rom_addr < 0x400000)
+		return 0x400000;
+
+	return 0;
+}
+
+/* 64K sectors, except for eight 8K boot sectors at the top or bottom
+ * (see flash_29lv320.c) */
+static uint32_t sectorSize(uint32_t rom_addr)
+{
+	if (rom_addr < 0x10000 || rom_addr >= 0x3F0000) {
+		return 0x2000;
+	}
+
+	return 0x10000;
+}
+
+/* Wait for the end of a program operation using DQ7. Returns 0 on success,
+ * -1 if the chip reports a failure (DQ5). */
+static int8_t waitProgram(uint16_t cartAddr, uint8_t data)
+{
+	uint8_t b;
+
+	while (1) {
+		b = cartRead(cartAddr);
+		if ((b & 0x80) == (data & 0x80))
+			return 0;
+
+		if (b & 0x20) {
+			// DQ7 may have changed at the same time as DQ5
+			b = cartRead(cartAddr);
+			if ((b & 0x80) == (data & 0x80))
+				return 0;
+			return -1;
+		}
+	}
+}
+
+static void programBytes(uint16_t cartAddr, uint8_t *data, int len)
+{
+	uint16_t start = cartAddr;
+	uint8_t bypass = !s_suspended && flash_hasUnlockBypass();
+	uint8_t phase;
+	int8_t res;
+
+	if (bypass) {
+		// Enter Unlock Bypass
+		cartWrite(0xAAA, 0xAA);
+		cartWrite(0x555, 0x55);
+		cartWrite(0xAAA, 0x20);
+	}
+
+	while (len--) {
+		// 0xFF is the erased state, nothing to program
+		if (*data == 0xFF) {
+			cartAddr++;
+			data++;
+			continue;
+		}
+
+		if (bypass) {
+			// Any address works, see flash_29lv320.c
+			cartWrite((cartAddr & 0xFFF0) | ((cartAddr + 8) & 0x000F), 0xA0);
+		} else {
+			cartWrite(0xAAA, 0xAA);
+			cartWrite(0x555, 0x55);
+			cartWrite(0xAAA, 0xA0);
+		}
+		cartWrite(cartAddr, *data);
+
+		phase = stats_phaseBegin(STATS_PH_FLASH_POLL);
+		res = waitProgram(cartAddr, *data);
+		stats_phaseEnd(phase);
+
+		if (res) {
+			cartWrite(cartAddr, 0xF0);
+			break;
+		}
+
+		cartAddr++;
+		data++;
+	}
+
+	if (bypass) {
+		// Unlock Bypass Reset
+		cartWrite(start, 0x90);
+		cartWrite(start, 0x00);
+	}
+}
+
+static void programByte(uint16_t cartAddr, uint8_t b)
+{
+	programBytes(cartAddr, &b, 1);
+}
+
+const struct flashops flash_s29jl032_ops PROGMEM = {
+	.readSiliconID = readSiliconID,
+	.detect = detect,
+	.chipErase = chipErase,
+	.programBytes = programBytes,
+	.programByte = programByte,
+	.sectorErase = sectorErase,
+	.sectorSize = sectorSize,
+	.sizes_guessed = 1,
+	.bankEnd = bankEnd,
+	.sectorEraseStart = sectorEraseStart,
+	.sectorEraseDone = sectorEraseDone,
+	.eraseSuspend = eraseSuspend,
+	.eraseResume = eraseResume,
+};
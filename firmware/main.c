@@ -33,6 +33,8 @@
 
 #include "usbstrings.h"
 #include "menu.h"
+#include "timer.h"
+#include "rpc.h"
 
 #define MAX_READ_ERRORS	30
 
@@ -55,7 +57,6 @@ struct cfg1 {
 	struct usb_interface_descriptor interface_data;
 	struct usb_endpoint_descriptor ep2_in;
 	struct usb_endpoint_descriptor ep3_out;
-
 };
 
 static const struct cfg1 cfg1 PROGMEM = {
@@ -116,7 +117,7 @@ static const struct cfg1 cfg1 PROGMEM = {
 		.bDescriptorType = ENDPOINT_DESCRIPTOR,
 		.bEndpointAddress = USB_RQT_HOST_TO_DEVICE | 3,
 		.bmAttributes = TRANSFER_TYPE_BULK,
-		.wMaxPacketsize = 8,
+		.wMaxPacketsize = 32,
 		.bInterval = LS_FS_INTERVAL_MS(10),
 	},
 
@@ -161,7 +162,7 @@ const struct usb_device_descriptor device_descriptor_cdcacm PROGMEM = {
 	.bDeviceClass = USB_DEVICE_CLASS_CDC,
 	.bDeviceSubClass = 0,
 	.bDeviceProtocol = 0,
-	.bMaxPacketSize = 64,
+	.bMaxPacketSize = 8,
 	.idVendor = 0x289B,
 	.idProduct = 0x0600,
 	.bcdDevice = VERSIONBCD, // 1.1.1
@@ -174,10 +175,12 @@ const struct usb_device_descriptor device_descriptor_cdcacm PROGMEM = {
 
 /** **/
 
-static struct usb_parameters usb_params_cdcacm = {
+// In program memory (see usb_init())
+static const struct usb_parameters usb_params_cdcacm PROGMEM = {
 	.flags = USB_PARAM_FLAG_CONFDESC_PROGMEM |
 				USB_PARAM_FLAG_DEVDESC_PROGMEM |
-					USB_PARAM_FLAG_REPORTDESC_PROGMEM,
+					USB_PARAM_FLAG_REPORTDESC_PROGMEM |
+						USB_PARAM_FLAG_STRINGS_PROGMEM,
 	.devdesc = (PGM_VOID_P)&device_descriptor_cdcacm,
 	.configdesc = (PGM_VOID_P)&cfg1,
 	.configdesc_ttllen = sizeof(cfg1),
@@ -187,10 +190,11 @@ static struct usb_parameters usb_params_cdcacm = {
 	.n_hid_interfaces = 0,
 
 	.epconfigs = {
-		[0] = { 1, EP_TYPE_CTL, EP_SIZE_64 },
+		// The 176 bytes of endpoint memory are used as 8 + 8 + 2*64 + 32.
+		[0] = { 1, EP_TYPE_CTL, EP_SIZE_8 },
 		[1] = { 1, EP_TYPE_INT | EP_TYPE_IN, EP_SIZE_8 },
-		[2] = { 1, EP_TYPE_BULK | EP_TYPE_IN, EP_SIZE_64 },
-		[3] = { 1, EP_TYPE_BULK | EP_TYPE_OUT, EP_SIZE_8, usbcomm_addbyte },
+		[2] = { 1, EP_TYPE_BULK | EP_TYPE_IN, EP_SIZE_64, NULL, EP_FLAG_DUAL_BANK },
+		[3] = { 1, EP_TYPE_BULK | EP_TYPE_OUT, EP_SIZE_32, .onPacketReceived = usbcomm_addpacket },
 	},
 };
 
@@ -249,14 +253,37 @@ void hwinit(void)
 
 static uint16_t cdcacm_sendBytes(const uint8_t *data, uint16_t length)
 {
-	if (usb_interruptReady(2)) {
-		usb_interruptSend(2, data, length);
-	//	while (!usb_interruptReady(2));
-		return length;
-	}
-	return 0;
+	// The data is copied to a free bank right away, so the caller
+	// can reuse its buffer as soon as this returns non-zero.
+	return usb_fifoTrySend(2, data, length);
+}
+
+static void cdcacm_rxResume(void)
+{
+	usb_rxResume(3);
+}
+
+static void cdcacm_streamBegin(void)
+{
+	usb_fifoBegin(2);
 }
 
+static void cdcacm_streamWrite(const uint8_t *data, uint8_t len)
+{
+	usb_fifoWrite(2, data, len);
+}
+
+static void cdcacm_streamEnd(void)
+{
+	usb_fifoEnd(2);
+}
+
+static const struct usbcomm_stream_ops cdcacm_stream_ops = {
+	.begin = cdcacm_streamBegin,
+	.write = cdcacm_streamWrite,
+	.end = cdcacm_streamEnd,
+};
+
 #define CMDBUF_SIZE	24
 
 static uint8_t cmdbuf[CMDBUF_SIZE];
@@ -269,8 +296,10 @@ int main(void)
 
 	hwinit();
 
-	usbcomm_init(cdcacm_sendBytes, USBCOMM_EN_STDOUT);
+	usbcomm_init(cdcacm_sendBytes, cdcacm_rxResume, USBCOMM_EN_STDOUT);
+	usbcomm_setStreamOps(&cdcacm_stream_ops);
 	usb_init(&usb_params_cdcacm);
+	timer_init();
 
 	sei();
 
@@ -287,6 +316,11 @@ int main(void)
 			b = usbcomm_rxbyte();
 			//printf("[%02x] ", b);
 
+			// Binary frames (see rpc.h) are not echoed
+			if (rpc_handleByte(b, cmdbufpos == 0)) {
+				continue;
+			}
+
 			if ((b=='\n')) {
 			}
 			else if (b=='\r') {
@@ -1,28 +1,114 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
 #include "cartio.h"
 #include "mapper.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Sega mapper: Slot registers at 0xFFFD-0xFFFF. The first 1K of slot 0
+ * always reads from bank 0. */
+static void sega_init(void)
+{
+	// Disable RAM, Enable ROM write
+	cartWriteClk(0xFFFC, 0x80);
+}
+
+static void sega_setSlot(uint8_t slot, uint8_t bank)
+{
+	cartWriteClk(0xFFFD + slot, bank);
+}
+
+static const struct mapperops mapper_sega_ops PROGMEM = {
+	.init = sega_init,
+	.setSlot = sega_setSlot,
+	.slot0_fixed = 0x400,
+	.plan_first_slot = SLOT1,
+};
+
+/* Codemasters mapper: Slot registers at the start of each slot (0x0000,
+ * 0x4000, 0x8000). All three slots can be fully remapped. Flash commands
+ * and data written at those addresses remap the slot too. */
+static void codemasters_setSlot(uint8_t slot, uint8_t bank)
+{
+	cartWriteClk((uint16_t)slot << 14, bank);
+}
+
+static const struct mapperops mapper_codemasters_ops PROGMEM = {
+	.setSlot = codemasters_setSlot,
+	.plan_first_slot = SLOT0,
+	.regs_in_rom = 1,
+};
+
+/* No mapper (SG-1000, cards, 32K cartridges): Up to 48K, read directly. */
+static const struct mapperops mapper_none_ops PROGMEM = {
+	.plan_first_slot = NUM_SLOTS,
+};
 
 static uint8_t mapper_type = MAPPER_TYPE_SEGA;
+// The tables are in program memory
+static const struct mapperops *ops = &mapper_sega_ops;
+#define OPS_FN(fn)	((__typeof__(ops->fn))pgm_read_word(&ops->fn))
+
+// Bank mapped in each slot, to skip writes which would change nothing
+static uint8_t s_slots[NUM_SLOTS] = { 0, 1, 2 };
+// Slots (bit n for slot n) where the above may be wrong
+static uint8_t s_slots_stale;
 
 void mapper_init(uint8_t type)
 {
+	uint8_t slot;
+
 	mapper_type = type;
 
-	if (mapper_type == MAPPER_TYPE_SEGA) {
-		// Disable RAM, Enable ROM write
-		cartWriteClk(0xFFFC, 0x80);
-		// Slot 0 -> Bank 0
-		cartWriteClk(0xFFFD, 0);
-		// Slot 1 -> Bank 1
-		cartWriteClk(0xFFFE, 1);
-		// Slot 2 -> Bank 2
-		cartWriteClk(0xFFFF, 2);
+	switch (type)
+	{
+		case MAPPER_TYPE_NONE: ops = &mapper_none_ops; break;
+		case MAPPER_TYPE_CODEMASTERS: ops = &mapper_codemasters_ops; break;
+		default: ops = &mapper_sega_ops; break;
 	}
+
+	if (OPS_FN(init)) {
+		OPS_FN(init)();
+	}
+
+	// Slot n -> Bank n. Always written, the cartridge may have changed.
+	for (slot=0; slot<NUM_SLOTS; slot++) {
+		if (OPS_FN(setSlot)) {
+			OPS_FN(setSlot)(slot, slot);
+		}
+		s_slots[slot] = slot;
+	}
+	s_slots_stale = 0;
 }
 
 void mapper_setSlot(uint8_t slot, uint8_t bank)
 {
-	cartWriteClk(0xFFFD+slot,bank);
+	if (!OPS_FN(setSlot))
+		return;
+	if (s_slots[slot] == bank && !(s_slots_stale & (1 << slot)))
+		return;
+
+	trace_add(TRACE_EV_MAPPER_SLOT, (slot << 8) | bank);
+	OPS_FN(setSlot)(slot, bank);
+	s_slots[slot] = bank;
+	s_slots_stale &= ~(1 << slot);
+}
+
+void mapper_invalidateSlots(void)
+{
+	if (pgm_read_byte(&ops->regs_in_rom)) {
+		s_slots_stale = (1 << NUM_SLOTS) - 1;
+	}
+}
+
+void mapper_resetSlots(void)
+{
+	uint8_t slot;
+
+	for (slot=0; slot<NUM_SLOTS; slot++) {
+		mapper_setSlot(slot, slot);
+	}
 }
 
 uint8_t mapper_getCurrentType(void)
@@ -30,4 +116,59 @@ uint8_t mapper_getCurrentType(void)
 	return mapper_type;
 }
 
+/* Read from the linear ROM address space. Bank 0 and 1 are read
+ * through slot 0/1 to support mapperless cartridges, other banks through
+ * the slot 2 window. The range must not cross a 16K bank boundary. */
+void mapper_readRom(uint32_t rom_addr, uint16_t len, uint8_t *dst)
+{
+	stats_count(STATS_CNT_BYTES_READ, len);
+
+	if (rom_addr < 0x8000) {
+		mapper_setSlot(rom_addr >> 14, rom_addr >> 14);
+		cartReadSequential(rom_addr, len, dst);
+	} else {
+		mapper_setSlot(SLOT2, (rom_addr >> 14));
+		cartReadSequential(0x8000 | (rom_addr & 0x3FFF), len, dst);
+	}
+}
+
+/* Slot where the bank is mapped (NUM_SLOTS if none). The fixed start of
+ * slot 0 only counts for bank 0. */
+static uint8_t findSlot(uint8_t bank, uint16_t offset)
+{
+	uint8_t slot;
+
+	for (slot=0; slot<NUM_SLOTS; slot++) {
+		if (s_slots[slot] != bank || (s_slots_stale & (1 << slot)))
+			continue;
+		if (slot == SLOT0 && bank != 0 && offset < pgm_read_word(&ops->slot0_fixed))
+			continue;
+		return slot;
+	}
 
+	return NUM_SLOTS;
+}
+
+void mapper_readRomPlanned(uint32_t rom_addr, uint16_t len, uint8_t *dst)
+{
+	uint8_t bank = rom_addr >> 14;
+	uint16_t offset = rom_addr & 0x3FFF;
+	uint8_t slot;
+
+	stats_count(STATS_CNT_BYTES_READ, len);
+
+	slot = findSlot(bank, offset);
+	if (slot == NUM_SLOTS) {
+		// Map this bank and the following ones
+		for (slot=pgm_read_byte(&ops->plan_first_slot); slot<NUM_SLOTS; slot++) {
+			mapper_setSlot(slot, bank++);
+		}
+		slot = findSlot(rom_addr >> 14, offset);
+		if (slot == NUM_SLOTS) {
+			// Nothing to map (no mapper). As before, through slot 2.
+			slot = SLOT2;
+		}
+	}
+
+	cartReadSequential(((uint16_t)slot << 14) | offset, len, dst);
+}
@@ -1,18 +1,47 @@
 #ifndef _mapper_h__
 #define _mapper_h__
 
+#include <stdint.h>
+
 enum {
 	MAPPER_TYPE_NONE = 0,
 	MAPPER_TYPE_SEGA = 1,
+	MAPPER_TYPE_CODEMASTERS = 2,
 };
 
 #define SLOT0	0
 #define SLOT1	1
 #define SLOT2	2
+#define NUM_SLOTS	3
+
+struct mapperops {
+	// Optional, called before the slots are set
+	void (*init)(void);
+	// Map a bank in a slot (NULL without a mapper)
+	void (*setSlot)(uint8_t slot, uint8_t bank);
+	// Bytes at the start of slot 0 which always read from bank 0
+	uint16_t slot0_fixed;
+	// Slots from this one to slot 2 are used by mapper_readRomPlanned()
+	uint8_t plan_first_slot;
+	// The slot registers are at addresses flash commands write to
+	uint8_t regs_in_rom;
+};
 
 void mapper_init(uint8_t type);
+/* Writes to the mapper are skipped when the bank is already in the slot */
 void mapper_setSlot(uint8_t slot, uint8_t bank);
+/* Slot n -> Bank n, the state mapper_readRom() and flash operations expect */
+void mapper_resetSlots(void);
+/* Call after writing to the cartridge other than through this module
+ * (flash commands). Where that may have hit a slot register, the next
+ * mapper_setSlot() writes it again. */
+void mapper_invalidateSlots(void);
 uint8_t mapper_getCurrentType(void);
+void mapper_readRom(uint32_t rom_addr, uint16_t len, uint8_t *dst);
+/* Like mapper_readRom(), but when the bank is not already mapped, it is
+ * mapped along with the banks which follow it in all the slots the mapper
+ * allows (slots 1-2 for Sega, 0-2 for Codemasters), so sequential reads
+ * remap less often. Use for dumps and call mapper_resetSlots() after. */
+void mapper_readRomPlanned(uint32_t rom_addr, uint16_t len, uint8_t *dst);
 
 #endif // _mapper_h__
-
@@ -28,6 +28,13 @@
 #include "mapper.h"
 #include "usbcomm.h"
 #include "flash.h"
+#include "cfi.h"
+#include "crc32.h"
+#include "zmodem.h"
+#include "stats.h"
+#include "timer.h"
+#include "trace.h"
+#include "util.h"
 
 
 static uint8_t is_flash_cartridge; // bool
@@ -89,15 +96,23 @@ static void showVersion(const char *line, int length)
 	puts_P(PSTR("Version: " VERSIONSTR));
 }
 
+/* Size of the on-stack buffer used when scanning cartridge ranges */
+#define SCAN_CHUNK	32
+
 static uint8_t cartrange_is_all_ff(uint16_t addr_start, uint16_t len)
 {
-	uint8_t b;
-
-	while (len--) {
-		b = cartRead(addr_start);
-		if (b != 0xff)
-			return 0;
-		addr_start++;
+	uint8_t buf[SCAN_CHUNK];
+	uint8_t i, n;
+
+	while (len) {
+		n = len > SCAN_CHUNK ? SCAN_CHUNK : len;
+		cartReadSequential(addr_start, n, buf);
+		for (i=0; i<n; i++) {
+			if (buf[i] != 0xff)
+				return 0;
+		}
+		addr_start += n;
+		len -= n;
 	}
 
 	return 1;
@@ -106,18 +121,477 @@ static uint8_t cartrange_is_all_ff(uint16_t addr_start, uint16_t len)
 
 static uint16_t crc16_cartrange(uint16_t addr_start, uint16_t len)
 {
+	uint8_t buf[SCAN_CHUNK];
 	uint16_t crc = 0;
-	uint8_t b;
+	uint8_t i, n;
 
-	while (len--) {
-		b = cartRead(addr_start);
-		crc = _crc_xmodem_update(crc, b);
-		addr_start++;
+	while (len) {
+		n = len > SCAN_CHUNK ? SCAN_CHUNK : len;
+		cartReadSequential(addr_start, n, buf);
+		for (i=0; i<n; i++) {
+			crc = _crc_xmodem_update(crc, buf[i]);
+		}
+		addr_start += n;
+		len -= n;
 	}
 
 	return crc;
 }
 
+// Bytes sampled per bank when looking for the bank 0 mirror
+#define SAMPLE_COUNT		256
+#define SAMPLE_STRIDE		(16384 / SAMPLE_COUNT)
+// Matching samples are trusted only if bank 0 is not too uniform
+#define SAMPLE_MIN_CHANGES	32
+
+#define SAMPLES_DIFFER		0
+#define SAMPLES_MATCH		1
+#define SAMPLES_AMBIGUOUS	2
+
+/* Compare bytes sampled across bank 0 (read at 0x0000) with the same
+ * offsets in the bank visible at addr_start. Sampled bytes which change
+ * from one sample to the next are counted: too few means bank 0 is mostly
+ * padding and a match could be a coincidence. */
+static uint8_t compareBankSamples(uint16_t addr_start)
+{
+	uint16_t i, offset;
+	uint8_t b, prev = 0, changes = 0;
+
+	for (i=0; i<SAMPLE_COUNT; i++) {
+		// Move around within each stride so that tables aligned to
+		// the stride are not always sampled at the same place.
+		offset = i * SAMPLE_STRIDE + ((i * 37) & (SAMPLE_STRIDE - 1));
+
+		b = cartRead(offset);
+		if (cartRead(addr_start + offset) != b) {
+			return SAMPLES_DIFFER;
+		}
+		if (b != prev && changes < 255) {
+			changes++;
+		}
+		prev = b;
+	}
+
+	return changes < SAMPLE_MIN_CHANGES ? SAMPLES_AMBIGUOUS : SAMPLES_MATCH;
+}
+
+/* Make a bank visible and return its address. Bank 1 is read directly
+ * (as bank 0), others through slot 2. */
+static uint16_t mapBankForRead(uint8_t bank)
+{
+	if (bank == 1) {
+		return 0x4000;
+	}
+
+	mapper_setSlot(SLOT2, bank);
+	return 0x8000;
+}
+
+/* Number of 16K banks according to the size code of the TMR SEGA header,
+ * rounded up to a power of two. Returns 0 without a valid header. */
+static uint8_t headerBanks(const uint8_t rom_header[16])
+{
+	if (memcmp_P(rom_header, PSTR("TMR SEGA"), 8)) {
+		return 0;
+	}
+
+	switch (rom_header[15] & 0x0F)
+	{
+		case 0xA: // 8K
+		case 0xB: return 1;
+		case 0xC: return 2;
+		case 0xD: // 48K
+		case 0xE: return 4;
+		case 0xF: return 8;
+		case 0x0: return 16;
+		case 0x1: return 32;
+		case 0x2: return 64;
+	}
+
+	return 0;
+}
+
+/* Bank 0 and the bank at addr_start are the same if the samples say so. If
+ * they are ambiguous, compare CRCs of the whole banks. */
+static uint8_t isBank0Mirror(uint16_t addr_start)
+{
+	switch (compareBankSamples(addr_start))
+	{
+		case SAMPLES_MATCH:
+			return 1;
+		case SAMPLES_AMBIGUOUS:
+			return crc16_cartrange(addr_start, 16384) == crc16_cartrange(0x0000, 16384);
+	}
+
+	return 0;
+}
+
+static void printMapperType(void)
+{
+	printf_P(PSTR("Mapper type: "));
+	switch(mapper_getCurrentType())
+	{
+		default: puts_P(PSTR("Unknown / invalid")); break;
+		case MAPPER_TYPE_NONE: puts_P(PSTR("None")); break;
+		case MAPPER_TYPE_SEGA: puts_P(PSTR("Sega")); break;
+		case MAPPER_TYPE_CODEMASTERS: puts_P(PSTR("Codemasters")); break;
+	}
+}
+
+/* mapper [none|sega|codemasters]: Show or select the mapper (init selects
+ * Sega, or none for 32K ROM cartridges) */
+static void cmd_mapper(const char *line, int length)
+{
+	newline();
+
+	if (strstr_P(line, PSTR("none"))) {
+		mapper_init(MAPPER_TYPE_NONE);
+	} else if (strstr_P(line, PSTR("sega"))) {
+		mapper_init(MAPPER_TYPE_SEGA);
+	} else if (strstr_P(line, PSTR("codemasters"))) {
+		mapper_init(MAPPER_TYPE_CODEMASTERS);
+	}
+
+	printMapperType();
+}
+
+static void printTimingProfile(void)
+{
+	printf_P(PSTR("Bus timing: "));
+	switch(cartio_getTimingProfile())
+	{
+		case CARTIO_TIMING_FAST: puts_P(PSTR("fast (flash)")); break;
+		case CARTIO_TIMING_ROM: puts_P(PSTR("rom (mask ROM)")); break;
+		case CARTIO_TIMING_SAFE: puts_P(PSTR("safe (conservative)")); break;
+		default: puts_P(PSTR("custom")); break;
+	}
+}
+
+static void cmd_timing(const char *line, int length)
+{
+	newline();
+
+	if (strstr_P(line, PSTR("fast"))) {
+		cartio_setTimingProfile(CARTIO_TIMING_FAST);
+	} else if (strstr_P(line, PSTR("rom"))) {
+		cartio_setTimingProfile(CARTIO_TIMING_ROM);
+	} else if (strstr_P(line, PSTR("safe"))) {
+		cartio_setTimingProfile(CARTIO_TIMING_SAFE);
+	}
+
+	printTimingProfile();
+}
+
+// Longest read strobe tried by the tune command
+#define TUNE_MAX_RD	8
+// Number of passing steps required above the fastest passing read strobe
+#define TUNE_MARGIN	1
+
+/* Switch slot 2 away from bank 1 and back (two real mapper writes, the
+ * slots are shadowed) and return the CRC of bank 1. */
+static uint16_t tune_bank1Crc(void)
+{
+	mapper_setSlot(SLOT2, 0);
+	mapper_setSlot(SLOT2, 1);
+	return crc16_cartrange(0x8000, 16384);
+}
+
+/* Sweep the read strobe length over bank 0 and compare against a CRC
+ * obtained with the conservative timing. Then pick the fastest profile
+ * that leaves enough margin. Only reads are exercised here, so the write
+ * strobe and mapper clock stay at their safe values, and the result is
+ * checked with bank switches and a read of bank 1. */
+static void cmd_tune(const char *line, int length)
+{
+	struct cartio_timing t, safe;
+	uint16_t ref_crc, ref_bank1_crc = 0, crc;
+	uint8_t rd, lowest_ok = 0xff, failed = 0;
+	uint8_t p, check_bank1;
+
+	newline();
+	usbcomm_drain();
+
+	// Slot 0 -> Bank 0 (works for mapperless cartridges too)
+	mapper_setSlot(SLOT0, 0);
+
+	cartio_setTimingProfile(CARTIO_TIMING_SAFE);
+	cartio_getTiming(&safe);
+	ref_crc = crc16_cartrange(0x0000, 16384);
+	printf_P(PSTR("Reference CRC: %04x\n"), ref_crc);
+
+	check_bank1 = mapper_getCurrentType() != MAPPER_TYPE_NONE && s_rom_size > 16384;
+	if (check_bank1) {
+		ref_bank1_crc = tune_bank1Crc();
+		printf_P(PSTR("Reference CRC (bank 1): %04x\n"), ref_bank1_crc);
+	}
+
+	// Sweep the read strobe, everything else at the fastest setting.
+	cartio_setTimingProfile(CARTIO_TIMING_FAST);
+	cartio_getTiming(&t);
+	for (rd = TUNE_MAX_RD; ; rd--) {
+		t.rd = rd;
+		cartio_setTiming(&t);
+		crc = crc16_cartrange(0x0000, 16384);
+
+		if (crc != ref_crc) {
+			failed = 1;
+		} else if (!failed) {
+			lowest_ok = rd;
+		}
+
+		printf_P(PSTR("RD delay %d (~%d ns): %S\n"), rd, (3 * rd + 4) * 125 / 2,
+					crc == ref_crc ? PSTR("PASS") : PSTR("FAIL"));
+		usbcomm_drain();
+
+		if (rd == 0)
+			break;
+	}
+
+	if (lowest_ok == 0xff) {
+		puts_P(PSTR("No passing setting found"));
+		cartio_setTimingProfile(CARTIO_TIMING_SAFE);
+		mapper_resetSlots();
+		printTimingProfile();
+		return;
+	}
+
+	// Profiles are ordered fastest first. Use the first one with enough
+	// margin which also reads bank 0 (and bank 1 after switching) correctly
+	// on its own.
+	for (p = 0; p < CARTIO_TIMING_SAFE; p++) {
+		cartio_setTimingProfile(p);
+		cartio_getTiming(&t);
+
+		if (t.rd < lowest_ok + TUNE_MARGIN)
+			continue;
+
+		t.wr = safe.wr;
+		t.clk = safe.clk;
+		cartio_setTiming(&t);
+
+		if (crc16_cartrange(0x0000, 16384) != ref_crc)
+			continue;
+		if (crc16_cartrange(0x0000, 16384) != ref_crc)
+			continue;
+		if (check_bank1 && tune_bank1Crc() != ref_bank1_crc)
+			continue;
+
+		printf_P(PSTR("Margin: %d step(s)\n"), t.rd - lowest_ok);
+		break;
+	}
+
+	if (p == CARTIO_TIMING_SAFE) {
+		cartio_setTimingProfile(CARTIO_TIMING_SAFE);
+	} else {
+		puts_P(PSTR("Write strobe and mapper clock kept at safe values"));
+	}
+
+	mapper_resetSlots();
+	printTimingProfile();
+}
+
+#define BENCH_ITERATIONS	4096
+#define BENCH_READ_SIZE		16384
+#define BENCH_TX_SIZE		8192
+#define BENCH_PROGRAM_SIZE	256
+
+/* Each benchmark returns the number of operations it performed (bytes
+ * for the transfer ones). Timings include the loop overhead. */
+static uint16_t bench_addrSeq(void)
+{
+	uint16_t i;
+
+	for (i=0; i<BENCH_ITERATIONS; i++) {
+		setCartAddress(i);
+	}
+
+	return BENCH_ITERATIONS;
+}
+
+static uint16_t bench_addrRandom(void)
+{
+	uint16_t i, addr = 0;
+
+	for (i=0; i<BENCH_ITERATIONS; i++) {
+		addr = addr * 25173 + 13849;
+		setCartAddress(addr);
+	}
+
+	return BENCH_ITERATIONS;
+}
+
+static uint16_t bench_cartRead(void)
+{
+	uint16_t i;
+
+	for (i=0; i<BENCH_ITERATIONS; i++) {
+		cartRead(i);
+	}
+
+	return BENCH_ITERATIONS;
+}
+
+static uint16_t bench_cartReadBytes(void)
+{
+	uint8_t buf[SCAN_CHUNK];
+	uint16_t addr;
+
+	for (addr=0; addr<BENCH_READ_SIZE; addr+=sizeof(buf)) {
+		cartReadBytes(addr, sizeof(buf), buf);
+	}
+
+	return BENCH_READ_SIZE;
+}
+
+static uint16_t bench_bankSwitch(void)
+{
+	uint16_t i;
+
+	for (i=0; i<BENCH_ITERATIONS; i++) {
+		mapper_setSlot(SLOT2, i & 0x1f);
+	}
+	mapper_setSlot(SLOT2, 2);
+
+	return BENCH_ITERATIONS;
+}
+
+static uint16_t bench_crc16(void)
+{
+	crc16_cartrange(0x0000, BENCH_READ_SIZE);
+
+	return BENCH_READ_SIZE;
+}
+
+static uint16_t bench_usbTx(void)
+{
+	uint8_t buf[32];
+	uint16_t i;
+
+	// Blanks overwritten by a carriage return, so a terminal shows nothing
+	memset(buf, ' ', sizeof(buf));
+	buf[sizeof(buf)-1] = '\r';
+
+	usbcomm_streamBegin();
+	for (i=0; i<BENCH_TX_SIZE; i+=sizeof(buf)) {
+		usbcomm_streamBytes(buf, sizeof(buf));
+	}
+	usbcomm_streamEnd();
+
+	return BENCH_TX_SIZE;
+}
+
+static uint16_t bench_flashProgram(void)
+{
+	uint8_t buf[SCAN_CHUNK];
+	uint32_t rom_addr = s_flash_size - BENCH_PROGRAM_SIZE;
+	uint16_t i;
+
+	memset(buf, 0x00, sizeof(buf));
+
+	for (i=0; i<BENCH_PROGRAM_SIZE; i+=sizeof(buf)) {
+		flash_programRom(rom_addr + i, buf, sizeof(buf));
+	}
+
+	return BENCH_PROGRAM_SIZE;
+}
+
+struct benchmark {
+	PGM_P name;
+	uint16_t (*run)(void);
+};
+
+static const char bench_name_addrseq[] PROGMEM = "addr sequential";
+static const char bench_name_addrrnd[] PROGMEM = "addr random";
+static const char bench_name_read[] PROGMEM = "cartRead";
+static const char bench_name_readbytes[] PROGMEM = "cartReadBytes 16K";
+static const char bench_name_bank[] PROGMEM = "bank switch";
+static const char bench_name_crc16[] PROGMEM = "crc16 16K";
+static const char bench_name_usbtx[] PROGMEM = "usb tx 8K";
+static const char bench_name_program[] PROGMEM = "flash program";
+
+static const struct benchmark benchmarks[] PROGMEM = {
+	{ bench_name_addrseq, bench_addrSeq },
+	{ bench_name_addrrnd, bench_addrRandom },
+	{ bench_name_read, bench_cartRead },
+	{ bench_name_readbytes, bench_cartReadBytes },
+	{ bench_name_bank, bench_bankSwitch },
+	{ bench_name_crc16, bench_crc16 },
+	{ bench_name_usbtx, bench_usbTx },
+	{ bench_name_program, bench_flashProgram }, // last, optional
+};
+
+static void runBenchmark(const struct benchmark *b)
+{
+	uint16_t (*run)(void) = (uint16_t (*)(void))pgm_read_word(&b->run);
+	uint32_t start, cycles;
+	uint16_t ops;
+	uint32_t per_op = 0, ops_per_s = 0;
+
+	usbcomm_drain();
+
+	start = timer_getCycles();
+	ops = run();
+	cycles = timer_getCycles() - start;
+
+	// In 1/100 us
+	if (ops) {
+		per_op = (cycles / ops) * 100 / (F_CPU / 1000000) +
+					((cycles % ops) * 100 / (F_CPU / 1000000)) / ops;
+	}
+	// Fits in 32 bits: 65535 * 16000 < 2^32
+	if (cycles >= 10) {
+		ops_per_s = (uint32_t)ops * (F_CPU / 1000) / (cycles / 10);
+	}
+
+	printf_P(PSTR("%-18S %6u %10lu %10lu %7lu.%02u\n"),
+			(PGM_P)pgm_read_word(&b->name), ops, cycles / (F_CPU / 1000000),
+			ops_per_s, per_op / 100, (uint16_t)(per_op % 100));
+}
+
+/* Run the microbenchmark suite over bank 0. "bench flash" also programs
+ * the last BENCH_PROGRAM_SIZE bytes of the flash, which must be blank (and
+ * need to be erased afterwards). */
+static void cmd_bench(const char *line, int length)
+{
+	uint8_t buf[SCAN_CHUNK];
+	uint8_t i, n = ARRAY_SIZE(benchmarks) - 1;
+	uint16_t j;
+
+	newline();
+
+	if (strstr_P(line, PSTR("flash"))) {
+		if (!is_flash_cartridge) {
+			puts_P(PSTR("Not a flash cartridge"));
+			return;
+		}
+
+		for (j=0; j<BENCH_PROGRAM_SIZE; j+=sizeof(buf)) {
+			mapper_readRom(s_flash_size - BENCH_PROGRAM_SIZE + j, sizeof(buf), buf);
+			for (i=0; i<sizeof(buf); i++) {
+				if (buf[i] != 0xff) {
+					puts_P(PSTR("End of flash not blank"));
+					return;
+				}
+			}
+		}
+		n++;
+	}
+
+	printTimingProfile();
+
+	// Slot 0 -> Bank 0 (works for mapperless cartridges too)
+	mapper_setSlot(SLOT0, 0);
+
+	printf_P(PSTR("%-18S %6S %10S %10S %10S\n"), PSTR("test"), PSTR("ops"), PSTR("us"), PSTR("ops/s"), PSTR("us/op"));
+
+	for (i=0; i<n; i++) {
+		runBenchmark(&benchmarks[i]);
+	}
+
+	// Slot 2 -> Bank 2
+	mapper_setSlot(SLOT2, 2);
+}
+
 static void debug2()
 {
 	uint8_t i;
@@ -150,6 +624,7 @@ static void debug_m1()
 
 	// Reset
 	cartWrite(0x0000, 0xF0);
+	mapper_invalidateSlots();
 
 }
 static void debug1()
@@ -192,19 +667,65 @@ static void printFlashInfo(uint16_t id)
 		case 0xa4c2: puts_P(PSTR("MX29F040 (supported)")); break;
 		case 0xa7c2: puts_P(PSTR("MX29LV320 (supported)")); break;
 		case 0x5001: puts_P(PSTR("S29JL032 (supported)")); break;
-		default: puts_P(PSTR(" (unknown/unsupported)")); break;
+		default:
+			if (flash_getCfi()->flags & CFI_FLAG_AMD_CMDSET) {
+				puts_P(PSTR("CFI compatible (supported)"));
+			} else {
+				puts_P(PSTR(" (unknown/unsupported)"));
+			}
+			break;
 	}
 }
 
+static void printYesNo(PGM_P label, uint8_t yes)
+{
+	printf_P(label);
+	puts_P(yes ? PSTR("yes") : PSTR("no"));
+}
+
+static void cmd_cfi(const char *line, int length)
+{
+	const struct cfi_info *cfi = flash_getCfi();
+	uint8_t i;
+
+	newline();
+
+	if (!cfi->width) {
+		puts_P(PSTR("No CFI information (run init first)"));
+		return;
+	}
+
+	printf_P(PSTR("Interface: %S\n"), cfi->width == 2 ? PSTR("x16 in byte mode") : PSTR("x8"));
+	printf_P(PSTR("Size: %lu bytes\n"), 1UL << cfi->size_exp);
+	for (i=0; i<cfi->num_regions; i++) {
+		printf_P(PSTR("Region %d: %u blocks of %lu bytes\n"), i, cfi->regions[i].count,
+					cfi->regions[i].size ? (uint32_t)cfi->regions[i].size << 8 : 128UL);
+	}
+	printf_P(PSTR("Byte program: typ. %u us, max. %lu us\n"), 1 << cfi->program_typ,
+				(1UL << cfi->program_typ) << cfi->program_max);
+	printf_P(PSTR("Block erase: typ. %lu ms, max. %lu ms\n"), 1UL << cfi->erase_typ,
+				(1UL << cfi->erase_typ) << cfi->erase_max);
+	if (cfi->chip_typ) {
+		printf_P(PSTR("Chip erase: typ. %lu ms, max. %lu ms\n"), 1UL << cfi->chip_typ,
+					(1UL << cfi->chip_typ) << cfi->chip_max);
+	}
+	printYesNo(PSTR("AMD command set: "), cfi->flags & CFI_FLAG_AMD_CMDSET);
+	printYesNo(PSTR("Unlock bypass: "), cfi->flags & CFI_FLAG_UNLOCK_BYPASS);
+	printYesNo(PSTR("Program during erase suspend: "), cfi->flags & CFI_FLAG_ERASE_SUSPEND);
+	printYesNo(PSTR("Simultaneous read/write: "), cfi->flags & CFI_FLAG_SIMULTANEOUS);
+	printYesNo(PSTR("Top boot: "), cfi->flags & CFI_FLAG_TOP_BOOT);
+}
+
 
 static void initCart(const char *line, int length)
 {
 	uint8_t rom_header[16];
-	uint16_t bank0_crc, crc;
-	uint8_t bank0_first, first_byte;
 	uint16_t id, read_addr;
 	int i;
 
+	// A different cartridge may have been inserted
+	cartio_setTimingProfile(CARTIO_TIMING_SAFE);
+
 	mapper_init(MAPPER_TYPE_SEGA);
 	flash_init();
 
@@ -213,34 +734,26 @@ static void initCart(const char *line, int length)
 	printHex(rom_header, 16);
 	newline();
 
-	mapper_setSlot(SLOT2,0);
-	bank0_crc = crc16_cartrange(0x0000, 16384);
-	bank0_first = cartRead(0x00);
-	printf_P(PSTR("Bank %d CRC: %04x, first byte %02x\n"), 0, bank0_crc, bank0_first);
-
-	for (i=1; i<64; i<<=1) {
-
-		// For bank 1 (as for bank 0 above), read directly instead
-		// of using the mapper and the page 2 window.
-		if (i==1) {
-			read_addr = 0x4000;
-		} else {
-			read_addr = 0x8000;
-			mapper_setSlot(SLOT2,i);
+	/* The size code from the header is only a hint (it may be missing or
+	 * smaller than the ROM). If bank 0 is mirrored where the header says,
+	 * but not at half that, the size is confirmed. Otherwise look for the
+	 * first mirror starting from bank 1. */
+	i = headerBanks(rom_header);
+	if (i) {
+		printf_P(PSTR("Header size: %d banks\n"), i);
+		if ((i == 1 || !isBank0Mirror(mapBankForRead(i >> 1))) &&
+			(i == 64 || isBank0Mirror(mapBankForRead(i)))) {
+			goto done;
 		}
-		first_byte = cartRead(read_addr);
+		puts_P(PSTR("Header size not confirmed, scanning"));
+	}
 
-		// Only bother computing and comparing the CRC if the first
-		// bytes are equal. This speeds things a lot.
-		if (first_byte == bank0_first) {
-			crc = crc16_cartrange(read_addr, 16384);
+	for (i=1; i<64; i<<=1) {
+		read_addr = mapBankForRead(i);
 
-			printf_P(PSTR("Bank %d CRC: %04x\n"), i, crc);
-			if (crc == bank0_crc) {
-				break;
-			}
-		} else {
-			printf_P(PSTR("Bank %d first byte: %02x\n"), i, first_byte);
+		if (isBank0Mirror(read_addr)) {
+			printf_P(PSTR("Bank %d mirrors bank 0\n"), i);
+			break;
 		}
 
 		// If bank 2 (and beyond) is all FF, this may be a mapper-less cartridge
@@ -250,6 +763,7 @@ static void initCart(const char *line, int length)
 			break;
 		}
 	}
+done:
 	setROMsize(i * 16384UL);
 	printROMsize();
 
@@ -264,7 +778,13 @@ static void initCart(const char *line, int length)
 		puts_P(PSTR("Cartridge type: ROM"));
 	}
 
-	mapper_init(MAPPER_TYPE_SEGA);
+	// Small ROM cartridges are read directly, without mapper writes
+	if (!is_flash_cartridge && s_rom_size <= 0x8000) {
+		mapper_init(MAPPER_TYPE_NONE);
+	} else {
+		mapper_init(MAPPER_TYPE_SEGA);
+	}
+	printMapperType();
 }
 
 static void cmd_info(const char *line, int length)
@@ -274,13 +794,8 @@ static void cmd_info(const char *line, int length)
 	newline();
 	printROMsize();
 
-	printf_P(PSTR("Mapper type: "));
-	switch(mapper_getCurrentType())
-	{
-		default: puts_P(PSTR("Unknown / invalid")); break;
-		case MAPPER_TYPE_NONE: puts_P(PSTR("None")); break;
-		case MAPPER_TYPE_SEGA: puts_P(PSTR("Sega")); break;
-	}
+	printMapperType();
+	printTimingProfile();
 
 	if (flash_detect()) {
 		id = flash_readSiliconID();
@@ -321,21 +836,62 @@ static void cmd_setromsize(const char *line, int length)
 	newline();
 }
 
+/* Size to blank check: the whole flash, or the ROM size for other cartridges */
+static uint32_t getBlankCheckSize(void)
+{
+	if (!is_flash_cartridge) {
+		puts_P(PSTR("Warning: Not a flash cartridge. Using auto-detected size..."));
+		return s_rom_size;
+	}
+
+	return s_flash_size;
+}
+
 static void cmd_blankcheck(const char *line, int length)
 {
+	uint8_t buf[SCAN_CHUNK];
 	uint32_t rom_addr;
-	uint8_t b;
 	uint32_t size;
+	uint8_t i;
 
 	newline();
 	puts_P(PSTR("Checking if chip is blank..."));
 
-	if (!is_flash_cartridge) {
-		puts_P(PSTR("Warning: Not a flash cartridge. Using auto-detected size..."));
-		size = s_rom_size;
-	} else {
-		size = s_flash_size;
+	size = getBlankCheckSize();
+
+	usbcomm_drain();
+
+	for (rom_addr=0; rom_addr < size; rom_addr += SCAN_CHUNK) {
+		mapper_readRomPlanned(rom_addr, SCAN_CHUNK, buf);
+
+		for (i=0; i<SCAN_CHUNK; i++) {
+			if (buf[i] != 0xff) {
+				mapper_resetSlots();
+				printf_P(PSTR("First non-blank byte at 0x%06lx\n"), rom_addr + i);
+				puts_P(PSTR("Cartridge is blank: NO"));
+				return;
+			}
+		}
 	}
+	mapper_resetSlots();
+	newline();
+
+	puts_P(PSTR("Cartridge is blank: YES"));
+}
+
+/* Blank check of each sector. Prints a map with one bit per sector (set if
+ * blank, sector 0 in the least significant bit of the first byte) in hex,
+ * and the first non-blank address. Each sector is only read up to its
+ * first non-blank byte. */
+static void cmd_blankmap(const char *line, int length)
+{
+	uint32_t rom_addr, size, dirty, first_dirty = 0;
+	uint16_t sectors = 0;
+	uint8_t bits = 0, blank = 1;
+
+	newline();
+
+	size = getBlankCheckSize();
 
 	usbcomm_drain();
 
@@ -344,28 +900,33 @@ static void cmd_blankcheck(const char *line, int length)
 	// Slot 1 -> Bank 1
 	mapper_setSlot(SLOT1, 1);
 
-	for (rom_addr=0; rom_addr < size; rom_addr++) {
-
-		// Read bank0/1 using slot0/1 to support mapperless cartridges.
-		if (rom_addr < 0x8000) {
-			b = cartRead(rom_addr);
-		} else {
-			// Use slot2 as a window in the ROM
-			if ((rom_addr & 0x3FFF)==0) {
-				// Only set when page changes (faster)
-				mapper_setSlot(SLOT2, (rom_addr >> 14));
-			}
-			b = cartRead(0x8000 | (rom_addr & 0x3FFF));
+	printf_P(PSTR("Blank map: "));
+	for (rom_addr=0; rom_addr < size; rom_addr += flash_getSectorSize(rom_addr)) {
+		if (flash_sectorIsBlank(rom_addr, &dirty)) {
+			bits |= 1 << (sectors & 7);
+		} else if (blank) {
+			blank = 0;
+			first_dirty = dirty;
 		}
 
-		if (b != 0xff) {
-			puts_P(PSTR("Cartridge is blank: NO"));
-			return;
+		sectors++;
+		if (!(sectors & 7)) {
+			printf_P(PSTR("%02x"), bits);
+			bits = 0;
 		}
 	}
+	if (sectors & 7) {
+		printf_P(PSTR("%02x"), bits);
+	}
 	newline();
 
-	puts_P(PSTR("Cartridge is blank: YES"));
+	printf_P(PSTR("Sectors: %u\n"), sectors);
+	if (blank) {
+		puts_P(PSTR("Cartridge is blank: YES"));
+	} else {
+		printf_P(PSTR("First non-blank byte at 0x%06lx\n"), first_dirty);
+		puts_P(PSTR("Cartridge is blank: NO"));
+	}
 }
 
 static void readaddress(const char *line, int length)
@@ -404,6 +965,103 @@ void chiperase(const char *line, int length)
 	puts_P(PSTR("Done."));
 }
 
+/* sh romaddrhex [lengthhex]: One line per sector of the range (default:
+ * up to the ROM size) with its address, size and CRC-32, all in hex.
+ * Preceded by "Sizes guessed" when the chip may erase more than a sector
+ * (see flash_sectorSizesKnown()). */
+static void cmd_sectorHash(const char *line, int length)
+{
+	uint32_t rom_addr, end, size;
+	char *e;
+
+	rom_addr = strtoul(line + 3, &e, 16);
+	if (e == line + 3) {
+		error();
+		return;
+	}
+	end = strtoul(e, &e, 16);
+	if (end) {
+		end += rom_addr;
+	} else {
+		end = s_rom_size;
+	}
+
+	newline();
+
+	if (!flash_sectorSizesKnown()) {
+		puts_P(PSTR("Sizes guessed"));
+	}
+
+	while (rom_addr < end) {
+		size = flash_getSectorSize(rom_addr);
+		rom_addr &= ~(size - 1);
+		printf_P(PSTR("%06lx %06lx %08lx\n"), rom_addr, size, flash_hashSector(rom_addr));
+		rom_addr += size;
+	}
+}
+
+/* hash: CRC-32 of each 16K bank up to the ROM size ("bank crc" in hex),
+ * then "Image size crc" for the whole ROM. Each chunk read is added to
+ * both the bank and the image CRC. */
+static void cmd_hash(const char *line, int length)
+{
+	uint8_t buf[16];
+	uint32_t rom_addr = 0, bank_crc, image_crc = 0;
+	uint16_t bank, n;
+
+	newline();
+	usbcomm_drain();
+
+	for (bank=0; rom_addr < s_rom_size; bank++) {
+		bank_crc = 0;
+
+		do {
+			n = sizeof(buf);
+			if (s_rom_size - rom_addr < n) {
+				n = s_rom_size - rom_addr;
+			}
+			mapper_readRomPlanned(rom_addr, n, buf);
+			bank_crc = crc32_update(bank_crc, buf, n);
+			image_crc = crc32_update(image_crc, buf, n);
+			rom_addr += n;
+		} while ((rom_addr & 0x3FFF) && rom_addr < s_rom_size);
+
+		printf_P(PSTR("%02x %08lx\n"), bank, bank_crc);
+	}
+	mapper_resetSlots();
+
+	printf_P(PSTR("Image %06lx %08lx\n"), s_rom_size, image_crc);
+}
+
+static void cmd_sectorErase(const char *line, int length)
+{
+	uint32_t rom_addr, size;
+	char *e;
+
+	rom_addr = strtoul(line + 3, &e, 16);
+	if (e == line + 3) {
+		error();
+		return;
+	}
+
+	newline();
+
+	size = flash_getSectorSize(rom_addr);
+	rom_addr &= ~(size - 1);
+
+	printf_P(PSTR("Erasing the %lu byte sector at 0x%06lx...\n"), size, rom_addr);
+	if (!flash_sectorSizesKnown()) {
+		puts_P(PSTR("Size guessed (no CFI), up to 64K may be erased"));
+	}
+	usbcomm_drain();
+	flash_eraseSector(rom_addr);
+
+	// Slot 2 -> Bank 2
+	mapper_setSlot(SLOT2, 2);
+
+	puts_P(PSTR("Done."));
+}
+
 void flashWrite(const char *line, int length)
 {
 	uint16_t addr;
@@ -482,25 +1140,76 @@ static int waitChar(uint16_t timeout_ms)
 	return -1;
 }
 
-static uint8_t s_packetbuf[133];
+static uint8_t s_packetbuf[MENU_PACKETBUF_SIZE];
+
+uint8_t *menu_getPacketBuffer(void)
+{
+	return s_packetbuf;
+}
 
 #define STATE_WAIT_SOH			0
 #define STATE_RX_DATA			1
 #define STATE_PROCESS_PACKET	2
 
-void uploadXmodem(const char *line, int length)
+/* One line per sector programmed by the last upload: ROM address, bytes
+ * programmed and CRC-32 of what was read back, all in hex. */
+static void printProgramCrcs(void)
+{
+	uint32_t rom_addr, count, crc;
+	uint8_t i;
+
+	for (i=0; flash_crcGet(i, &rom_addr, &count, &crc); i++) {
+		printf_P(PSTR("%06lx %06lx %08lx\n"), rom_addr, count, crc);
+	}
+	if (i < flash_crcCount()) {
+		puts_P(PSTR("CRC table full"));
+	}
+}
+
+static void cmd_crc(const char *line, int length)
+{
+	newline();
+	flash_crcEnd();
+	printProgramCrcs();
+}
+
+/* Check the checksum (and packet number complement, except in sparse mode)
+ * of the packet in s_packetbuf. */
+static uint8_t xmodemPacketValid(uint8_t sparse)
+{
+	uint8_t i, sum = 0;
+
+	if (!sparse && (uint8_t)~s_packetbuf[1] != s_packetbuf[2]) {
+		return 0;
+	}
+
+	for (i=3; i<131; i++) {
+		sum += s_packetbuf[i];
+	}
+
+	return sum == s_packetbuf[131];
+}
+
+/* Receive an upload and program it. In sparse mode, the two bytes following
+ * SOH are the block number (ROM address / 128, little endian) instead of the
+ * packet number and its complement. This lets the host leave out blocks which
+ * are all 0xFF. Blocks must still be sent in ascending order. */
+static void xmodemReceive(void (*program)(uint32_t rom_addr, const uint8_t *data, uint8_t len), uint8_t sparse)
 {
 	uint8_t state = STATE_WAIT_SOH;
 	uint8_t send_nack, skip_ack=0;
 	uint8_t packet_size = 132;
 	uint8_t datpos = 0;
 	uint32_t rom_addr = 0;
-	uint8_t last_packet_id = 0;
+	uint16_t packet_id;
+	uint16_t last_packet_id = sparse ? 0xFFFF : 0;
+	uint8_t phase;
 	int c, b;
 
 	newline();
 	puts_P(PSTR("READY. Please start uploading."));
 
+	flash_crcBegin();
 	send_nack = 1;
 	while (1)
 	{
@@ -508,17 +1217,27 @@ void uploadXmodem(const char *line, int length)
 		for (c=0; c<10000; c++) {
 			if (state == STATE_WAIT_SOH) {
 				if (!skip_ack) {
+					// The first NAK only starts the transfer
+					if (send_nack && rom_addr) {
+						stats_count(STATS_CNT_NAKS, 1);
+					}
 					putchar(send_nack ? 0x15 : 0x06);
 					usbcomm_drain();
 				}
 				skip_ack = 0;
 			}
 
+			phase = stats_phaseBegin(STATS_PH_HOST_WAIT);
 			b = waitChar(500); // 0.5
+			stats_phaseEnd(phase);
 			if (b >= 0)
 				break;
+			if (rom_addr) {
+				stats_count(STATS_CNT_TIMEOUTS, 1);
+			}
 		}
 		if (b < 0) {
+			flash_crcEnd();
 			puts_P(PSTR("Timeout"));
 			return;
 		}
@@ -528,16 +1247,20 @@ void uploadXmodem(const char *line, int length)
 			case STATE_WAIT_SOH:
 				if (b == 0x01) {
 					state = STATE_RX_DATA;
+					trace_add(TRACE_EV_XMODEM_STATE, state);
 					datpos = 1;
 					s_packetbuf[0] = b;
 				} else if ((b == 0x03)||(b == 0x18)) {
+					flash_crcEnd();
 					newline();
 					puts_P(PSTR("Upload interrupted"));
 					return;
 				} else if ((b == 0x04)) { // End of transmission
 					putchar(0x06); // ACK
+					flash_crcEnd();
 					newline();
 					puts_P(PSTR("End of transmission - done"));
+					printProgramCrcs();
 					return;
 				}
 				break;
@@ -550,56 +1273,180 @@ void uploadXmodem(const char *line, int length)
 					break;
 				}
 				state = STATE_PROCESS_PACKET;
+				trace_add(TRACE_EV_XMODEM_STATE, state | (s_packetbuf[1] << 8));
 				// fallthrough...
 
 			case STATE_PROCESS_PACKET:
-				// Todo : Check sequence numbers, CRC...
-				if (s_packetbuf[1] != last_packet_id) {
-					// New packet
-
-					// Send ACK now, so the host gets notified while programming is taking place
-//					putchar(0x06);
-//					usbcomm_drain();
-//					skip_ack = 1;
-
-					// Access the flash through slot 2
-					mapper_setSlot(SLOT2, rom_addr >> 14);
-					flash_programBytes(0x8000 | (rom_addr & 0x3FFF), &s_packetbuf[3], 128);
+				if (!xmodemPacketValid(sparse)) {
+					// Ask for it again
+					send_nack = 1;
+					state = STATE_WAIT_SOH;
+					break;
+				}
+
+				packet_id = s_packetbuf[1];
+				if (sparse) {
+					packet_id |= s_packetbuf[2] << 8;
+					rom_addr = (uint32_t)packet_id << 7;
+				}
+
+				if (packet_id != last_packet_id) {
+					// New packet. Send ACK now, so the host sends the next one
+					// (into the receive buffer) while this one is programmed.
+					putchar(0x06);
+					usbcomm_drain();
+					skip_ack = 1;
+
+					program(rom_addr, &s_packetbuf[3], 128);
 					rom_addr += 128;
 					send_nack = 0;
 
-					last_packet_id = s_packetbuf[1];
+					last_packet_id = packet_id;
 				} else {
 					// Just ignore a duplicate packet
+					stats_count(STATS_CNT_RETRANSMITS, 1);
 					send_nack = 0;
 				}
 
 				state = STATE_WAIT_SOH;
+				trace_add(TRACE_EV_XMODEM_STATE, state | (s_packetbuf[1] << 8));
 				break;
 		}
 	}
 }
 
+void uploadXmodem(const char *line, int length)
+{
+	xmodemReceive(flash_programRom, 0);
+}
+
+/* uxe, use and uze take the image size (hex) as an optional argument, so
+ * sectors past the image are never erased ahead. */
+static uint32_t uploadImageSize(const char *line)
+{
+	return strtoul(line + 3, NULL, 16);
+}
+
+static void uploadXmodemErase(const char *line, int length)
+{
+	flash_jitEraseReset(uploadImageSize(line));
+	xmodemReceive(flash_programRomJit, 0);
+	flash_waitIdle();
+}
+
+static void uploadSparse(const char *line, int length)
+{
+	xmodemReceive(flash_programRom, 1);
+}
+
+static void uploadSparseErase(const char *line, int length)
+{
+	flash_jitEraseReset(uploadImageSize(line));
+	xmodemReceive(flash_programRomJit, 1);
+	flash_waitIdle();
+}
+
+#define XMODEM_BLOCK_SIZE	128
+#define PREFETCH_CHUNK		32
+
+/* Read-ahead of the next XMODEM block into s_packetbuf, a chunk at a time,
+ * with the checksum and CRC accumulated as the data comes in. */
+struct xmodem_prefetch {
+	uint32_t rom_addr;
+	uint8_t count;
+	uint8_t sum;
+	uint16_t crc;
+};
+
+static void xmodemPrefetchStart(struct xmodem_prefetch *pf, uint32_t rom_addr)
+{
+	pf->rom_addr = rom_addr;
+	pf->count = 0;
+	pf->sum = 0;
+	pf->crc = 0;
+}
+
+static void xmodemPrefetchChunk(struct xmodem_prefetch *pf)
+{
+	uint8_t *p = s_packetbuf + 3 + pf->count;
+	uint8_t i;
+
+	mapper_readRomPlanned(pf->rom_addr + pf->count, PREFETCH_CHUNK, p);
+
+	for (i=0; i<PREFETCH_CHUNK; i++) {
+		pf->crc = _crc_xmodem_update(pf->crc, p[i]);
+		pf->sum += p[i];
+	}
+
+	pf->count += PREFETCH_CHUNK;
+}
+
+/* (Re)send a block straight from the cartridge to the endpoint FIFO, without
+ * touching s_packetbuf (which may hold the block being read ahead). */
+static void xmodemStreamBlock(uint32_t rom_addr, uint8_t packetno, char crc_mode)
+{
+	uint8_t chunk[16];
+	uint8_t i, j, sum = 0;
+	uint16_t crc = 0;
+
+	chunk[0] = 0x01; // SOH
+	chunk[1] = packetno;
+	chunk[2] = ~packetno;
+
+	usbcomm_streamBegin();
+	usbcomm_streamBytes(chunk, 3);
+
+	for (i=0; i<XMODEM_BLOCK_SIZE; i+=sizeof(chunk)) {
+		mapper_readRomPlanned(rom_addr + i, sizeof(chunk), chunk);
+		for (j=0; j<sizeof(chunk); j++) {
+			crc = _crc_xmodem_update(crc, chunk[j]);
+			sum += chunk[j];
+		}
+		usbcomm_streamBytes(chunk, sizeof(chunk));
+	}
+
+	if (crc_mode) {
+		chunk[0] = crc >> 8;
+		chunk[1] = crc;
+		usbcomm_streamBytes(chunk, 2);
+	} else {
+		usbcomm_streamBytes(&sum, 1);
+	}
+
+	usbcomm_streamEnd();
+}
+
 void downloadXmodem(const char *line, int length)
 {
+	struct xmodem_prefetch pf;
 	uint8_t packetno = 1, b;
-	uint16_t crc;
 	uint32_t rom_addr = 0;
-	int i, j, n_blocks;
+	uint16_t i, n_blocks;
 	char crc_mode;
 	uint8_t packet_size;
+	uint8_t phase;
 
-	n_blocks = s_rom_size / 128;
+	n_blocks = s_rom_size / XMODEM_BLOCK_SIZE;
 
-	printf_P(PSTR("Dumping the rom using XMmodem. %d blocks.\n"), n_blocks);
+	printf_P(PSTR("Dumping the rom using XMmodem. %u blocks.\n"), n_blocks);
 	puts_P(PSTR("Please start the download... CTRL+C to cancel."));
 
+	// Slot 0 -> Bank 0
+	mapper_setSlot(SLOT0, 0);
+	// Slot 1 -> Bank 1
+	mapper_setSlot(SLOT1, 1);
+
+	xmodemPrefetchStart(&pf, rom_addr);
+
+	phase = stats_phaseBegin(STATS_PH_HOST_WAIT);
+
 	while (1) {
 		usbcomm_doTasks();
 
 		if (usbcomm_hasData()) {
 			b = usbcomm_rxbyte();
 			if (b == 0x03) {
+				stats_phaseEnd(phase);
 				newline();
 				puts_P(PSTR("Transfer cancelled."));
 				newline();
@@ -615,27 +1462,22 @@ void downloadXmodem(const char *line, int length)
 				packet_size = 132;
 				break;
 			}
+		} else if (pf.count < XMODEM_BLOCK_SIZE) {
+			// Read the first block while waiting for the receiver
+			xmodemPrefetchChunk(&pf);
 		}
 
 	}
 
-	s_packetbuf[0] = 0x01; // SOH
+	stats_phaseEnd(phase);
 
-	// Slot 0 -> Bank 0
-	mapper_setSlot(SLOT0, 0);
-	// Slot 1 -> Bank 1
-	mapper_setSlot(SLOT1, 1);
+	s_packetbuf[0] = 0x01; // SOH
 
 	for (i=0; i<n_blocks; i++)
 	{
-
-		if (rom_addr < 0x8000) {
-			// Read bank0/1 using slot0/1 to support mapperless cartridges.
-			cartReadBytes(rom_addr, 128, s_packetbuf + 3);
-		} else {
-			// Use slot2 as a window in the ROM
-			mapper_setSlot(SLOT2, (rom_addr >> 14));
-			cartReadBytes(0x8000 | (rom_addr & 0x3FFF), 128, s_packetbuf + 3);
+		// Finish reading the block if the host was faster than the read-ahead
+		while (pf.count < XMODEM_BLOCK_SIZE) {
+			xmodemPrefetchChunk(&pf);
 		}
 
 		// Prepare the X-modem packet
@@ -643,54 +1485,63 @@ void downloadXmodem(const char *line, int length)
 		s_packetbuf[2] = ~packetno;	// packet number complement
 
 		if (crc_mode) {
-			crc = 0;
-			for (j=3; j<131; j++) {
-				crc = _crc_xmodem_update(crc, s_packetbuf[j]);
-			}
-			s_packetbuf[131] = crc >> 8;
-			s_packetbuf[132] = crc;
+			s_packetbuf[131] = pf.crc >> 8;
+			s_packetbuf[132] = pf.crc;
 		} else {
-			uint8_t chk = 0;
 			// Sum of data bytes only
-			for (j=3; j<131; j++) {
-				chk += s_packetbuf[j];
-			}
-			s_packetbuf[131] = chk;
+			s_packetbuf[131] = pf.sum;
 		}
 
-		// Send it
-		usbcomm_txbytes(s_packetbuf, packet_size);
-		usbcomm_drain();
+		// Send it straight to the endpoint FIFO
+		usbcomm_streamBegin();
+		usbcomm_streamBytes(s_packetbuf, packet_size);
+		usbcomm_streamEnd();
+		trace_add(TRACE_EV_XMODEM_BLOCK, packetno);
+
+		// Start reading the next block while the host checks this one.
+		xmodemPrefetchStart(&pf, rom_addr + XMODEM_BLOCK_SIZE);
 
 		// Wait ack
 		//
+		phase = stats_phaseBegin(STATS_PH_HOST_WAIT);
 		while (1) {
 			usbcomm_doTasks();
 			if (usbcomm_hasData()) {
 				b = usbcomm_rxbyte();
-				if (b == 0x06) // ACK
+				if (b == 0x06) { // ACK
+					trace_add(TRACE_EV_XMODEM_ACK, packetno);
 					break;
+				}
 				if (b == 0x15) { // NACK
-					usbcomm_txbytes(s_packetbuf, packet_size);
-					usbcomm_drain();
+					trace_add(TRACE_EV_XMODEM_NAK, packetno);
+					stats_count(STATS_CNT_NAKS, 1);
+					stats_count(STATS_CNT_RETRANSMITS, 1);
+					// s_packetbuf now holds (part of) the next block. Read
+					// this one again from the cartridge.
+					xmodemStreamBlock(rom_addr, packetno, crc_mode);
 				}
 				if (b == 0x18) { // CAN
+					stats_phaseEnd(phase);
 					newline();
-					puts(PSTR("Transfer cancelled"));
+					puts_P(PSTR("Transfer cancelled"));
 					newline();
 					goto done;
 				}
+			} else if (i + 1 < n_blocks && pf.count < XMODEM_BLOCK_SIZE) {
+				xmodemPrefetchChunk(&pf);
 			}
 		}
+		stats_phaseEnd(phase);
 
 
-		rom_addr += 128;
+		rom_addr += XMODEM_BLOCK_SIZE;
 		packetno++;
 	}
 
 	// EOT
 	putchar(0x04);
 
+	phase = stats_phaseBegin(STATS_PH_HOST_WAIT);
 	while (1) {
 		usbcomm_doTasks();
 
@@ -700,61 +1551,177 @@ void downloadXmodem(const char *line, int length)
 				break;
 		}
 	}
+	stats_phaseEnd(phase);
 
 
 done:
-	// Slot 2 -> Bank 2
+	mapper_resetSlots();
+}
+
+static void downloadZmodem(const char *line, int length)
+{
+	int8_t res;
+
+	printf_P(PSTR("Dumping the rom using ZModem. %lu bytes.\n"), s_rom_size);
+	puts_P(PSTR("Please start the receiver (rz)... CTRL+X x5 to cancel."));
 
+	res = zmodem_send(PSTR("rom.bin"), s_rom_size, mapper_readRomPlanned);
+
+	mapper_resetSlots();
+
+	newline();
+	puts_P(res ? PSTR("Transfer failed") : PSTR("Transfer complete"));
+}
+
+static void zmodemReceive(zmodem_write_fn program)
+{
+	uint32_t received;
+	int8_t res;
+
+	newline();
+	puts_P(PSTR("READY. Please start uploading (sz)."));
+
+	flash_crcBegin();
+	res = zmodem_receive(s_packetbuf, program, &received);
+	flash_crcEnd();
+
+	// Slot 2 -> Bank 2
 	mapper_setSlot(SLOT2, 2);
+
+	newline();
+	printf_P(PSTR("%S - %lu bytes programmed\n"), res ? PSTR("Transfer failed") : PSTR("Transfer complete"), received);
+	if (!res) {
+		printProgramCrcs();
+	}
 }
 
-void menu_handleLine(const uint8_t *line, int length)
+static void uploadZmodem(const char *line, int length)
+{
+	zmodemReceive(flash_programRom);
+}
+
+static void uploadZmodemErase(const char *line, int length)
 {
+	flash_jitEraseReset(uploadImageSize(line));
+	zmodemReceive(flash_programRomJit);
+	flash_waitIdle();
+}
+
+static void cmd_stats(const char *line, int length)
+{
+	newline();
+
+	if (strstr_P(line, PSTR("reset"))) {
+		stats_reset();
+		puts_P(PSTR("Statistics cleared"));
+		return;
+	}
+
+	stats_print();
+}
+
+static void cmd_trace(const char *line, int length)
+{
+	if (strstr_P(line, PSTR("clear"))) {
+		newline();
+		trace_clear();
+		usbcomm_resetHighWater();
+		puts_P(PSTR("Trace cleared"));
+		return;
+	}
+
+	// Binary, see trace.h
+	newline();
+	usbcomm_drain();
+	trace_dump();
+}
+
+/* The commands. Matching is done by prefix in this order, so a command
+ * must come before any shorter command it starts with. */
+#define MENU_COMMANDS(X) \
+	X(boot, "boot", "Enter DFU bootloader") \
+	X(reset, "reset", "Reset the firmware") \
+	X(showVersion, "version", "Show version") \
+	X(initCart, "init", "Init. mapper hw, detect cart size, detect flash...") \
+	X(cmd_info, "info", "Display current info/setup") \
+	X(cmd_cfi, "cfi", "Show the flash CFI information (after init)") \
+	X(cmd_setromsize, "setromsize ", "Set download/blankcheck size") \
+	X(cmd_blankcheck, "bc", "Check if cartridge is blank") \
+	X(cmd_blankmap, "bm", "Blank check of each sector (bitmap)") \
+	X(readaddress, "r ", "addresshex [length]") \
+	X(downloadXmodem, "dx", "Download the ROM with XModem") \
+	X(uploadXmodemErase, "uxe", "[sizehex] Like ux, erasing sectors as needed") \
+	X(uploadXmodem, "ux", "Upload and program FLASH with XModem") \
+	X(downloadZmodem, "dz", "Download the ROM with ZModem") \
+	X(uploadZmodemErase, "uze", "[sizehex] Like uz, erasing sectors as needed") \
+	X(uploadZmodem, "uz", "Upload and program FLASH with ZModem") \
+	X(uploadSparseErase, "use", "[sizehex] Like us, erasing sectors as needed") \
+	X(uploadSparse, "us", "Upload and program FLASH, blocks carry their address") \
+	X(cmd_timing, "timing", "[fast|rom|safe] Show or set bus timing") \
+	X(cmd_mapper, "mapper", "[none|sega|codemasters] Show or set the mapper type") \
+	X(cmd_tune, "tune", "Find the fastest reliable bus timing") \
+	X(cmd_bench, "bench", "[flash] Run benchmarks (flash: program the end of a blank flash)") \
+	X(cmd_stats, "stats", "[reset] Show or clear performance counters") \
+	X(cmd_trace, "trace", "[clear] Dump (binary) or clear the event trace") \
+	X(chiperase, "ce", "Perform a chip erase operation") \
+	X(cmd_sectorErase, "se ", "romaddresshex Erase one sector") \
+	X(cmd_crc, "crc", "CRC-32 of each sector programmed by the last upload") \
+	X(cmd_sectorHash, "sh ", "romaddresshex [lengthhex] CRC-32 of each sector") \
+	X(cmd_hash, "hash", "CRC-32 of each 16K bank and of the whole ROM") \
+	X(flashWrite, "fw", "addresshex hexbyte") \
+	X(debug1, "d1", "Debug 1") \
+	X(debug2, "d2", "Debug 2") \
+	X(debug_m1, "m1", "M test 1")
+
+struct commandHandler {
+	PGM_P cmd;
+	void (*handler)(const char *line, int length);
+	PGM_P help;
+};
+
+// Kept in program memory, SRAM is scarce.
+#define COMMAND_STRINGS(handler, cmd, help) \
+	static const char handler##_cmd[] PROGMEM = cmd; \
+	static const char handler##_help[] PROGMEM = help;
+#define COMMAND_ENTRY(handler, cmd, help) { handler##_cmd, handler, handler##_help },
+
+MENU_COMMANDS(COMMAND_STRINGS)
+
+static const struct commandHandler handlers[] PROGMEM = {
+	MENU_COMMANDS(COMMAND_ENTRY)
+};
+
+void menu_runCommand(const uint8_t *line, int length)
+{
+	void (*handler)(const char *line, int length);
+	PGM_P cmd;
+	PGM_P help;
 	uint8_t i;
 
-	struct commandHandler {
-		const char *cmd;
-		void (*handler)(const char *line, int length);
-		const char *help;
-	} handlers[] = {
-		{ PSTR("boot"), boot, PSTR("Enter DFU bootloader") },
-		{ PSTR("reset"), reset, PSTR("Reset the firmware") },
-		{ PSTR("version"), showVersion, PSTR("Show version") },
-		{ PSTR("init"), initCart, PSTR("Init. mapper hw, detect cart size, detect flash...") },
-		{ PSTR("info"), cmd_info, PSTR("Display current info/setup") },
-		{ PSTR("setromsize "), cmd_setromsize, PSTR("Set download/blankcheck size") },
-		{ PSTR("bc"), cmd_blankcheck, PSTR("Check if cartridge is blank") },
-		{ PSTR("r "), readaddress, PSTR("addresshex [length]") },
-		{ PSTR("dx"), downloadXmodem, PSTR("Download the ROM with XModem") },
-		{ PSTR("ux"), uploadXmodem, PSTR("Upload and program FLASH with XModem") },
-		{ PSTR("ce"), chiperase, PSTR("Perform a chip erase operation") },
-		{ PSTR("fw"), flashWrite, PSTR("addresshex hexbyte") },
-		{ PSTR("d1"), debug1, PSTR("Debug 1") },
-		{ PSTR("d2"), debug2, PSTR("Debug 2") },
-		{ PSTR("m1"), debug_m1, PSTR("M test 1") },
-		{ }
-	};
-
-
-	for (i=0; handlers[i].handler; i++) {
-		if (strncmp_P((const char *)line, handlers[i].cmd, strlen_P(handlers[i].cmd)) == 0) {
-			handlers[i].handler((const char *)line, length);
-			goto done;
+	// A binary frame upload may have left an erase running
+	flash_waitIdle();
+
+	for (i=0; i<ARRAY_SIZE(handlers); i++) {
+		cmd = (PGM_P)pgm_read_word(&handlers[i].cmd);
+		if (strncmp_P((const char *)line, cmd, strlen_P(cmd)) == 0) {
+			handler = (void*)pgm_read_word(&handlers[i].handler);
+			handler((const char *)line, length);
+			return;
 		}
 	}
 
 	newline();
 	if (length == 0) {
-		goto done;
+		return;
 	}
 	else if (line[0] == '?') {
 		puts_P(PSTR("Supported commands:"));
-		for (i=0; handlers[i].handler; i++) {
+		for (i=0; i<ARRAY_SIZE(handlers); i++) {
+			cmd = (PGM_P)pgm_read_word(&handlers[i].cmd);
+			help = (PGM_P)pgm_read_word(&handlers[i].help);
 			printf_P(PSTR("  "));
-			printf_P(PSTR("  %-12S  "), handlers[i].cmd);
-			if (handlers[i].help) {
-				printf_P(handlers[i].help);
-			}
+			printf_P(PSTR("  %-12S  "), cmd);
+			printf_P(help);
 			newline();
 		}
 		newline();
@@ -762,8 +1729,21 @@ void menu_handleLine(const uint8_t *line, int length)
 		error();
 		newline();
 	}
+}
 
-done:
+void menu_handleLine(const uint8_t *line, int length)
+{
+	menu_runCommand(line, length);
 	printPrompt();
 }
 
+uint32_t menu_getRomSize(void)
+{
+	return s_rom_size;
+}
+
+uint32_t menu_getFlashSize(void)
+{
+	return is_flash_cartridge ? s_flash_size : 0;
+}
+
@@ -1,6 +1,20 @@
 #ifndef _menu_h__
 #define _menu_h__
 
+#include <stdint.h>
+
 void menu_handleLine(const uint8_t *line, int length);
+/* Like menu_handleLine(), without printing the prompt */
+void menu_runCommand(const uint8_t *line, int length);
+
+/* ROM size (detected by init or set by setromsize) */
+uint32_t menu_getRomSize(void);
+/* Flash size, 0 if not a flash cartridge */
+uint32_t menu_getFlashSize(void);
+
+/* The XMODEM/ZModem packet buffer, free between commands. rpc.c assembles
+ * frames in it. */
+#define MENU_PACKETBUF_SIZE	133
+uint8_t *menu_getPacketBuffer(void);
 
 #endif // _menu_h__
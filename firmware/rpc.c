@@ -0,0 +1,271 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+#include "rpc.h"
+#include "menu.h"
+#include "usbcomm.h"
+#include "mapper.h"
+#include "flash.h"
+#include "timer.h"
+
+// Opcode, request ID, length, payload, CRC
+#define FRAME_HEADER_SIZE	3
+#define FRAME_MAX_SIZE		(FRAME_HEADER_SIZE + RPC_MAX_PAYLOAD + 2)
+// Reply data (read data, command output) is gathered after the frame
+#define OUT_CHUNK			32
+
+#if FRAME_MAX_SIZE + OUT_CHUNK > MENU_PACKETBUF_SIZE
+#error Frames do not fit in the menu packet buffer
+#endif
+
+// Points to the menu packet buffer (SRAM is scarce)
+static uint8_t *s_frame;
+// Bytes received after the sync byte
+static uint16_t s_pos;
+static uint8_t s_in_frame;
+static uint32_t s_last_ticks;
+// RPC_OP_PROGRAM_BEGIN started the upload
+static uint8_t s_upload_begun;
+
+static uint8_t s_outlen;
+
+#define OUT_BUF	(s_frame + FRAME_MAX_SIZE)
+
+static void sendReply(uint8_t status, const uint8_t *data, uint8_t len)
+{
+	uint8_t hdr[5] = { RPC_REPLY_SYNC, s_frame[0], s_frame[1], status, len };
+	uint16_t crc = 0;
+	uint8_t i;
+
+	for (i=1; i<sizeof(hdr); i++) {
+		crc = _crc_xmodem_update(crc, hdr[i]);
+	}
+	for (i=0; i<len; i++) {
+		crc = _crc_xmodem_update(crc, data[i]);
+	}
+
+	usbcomm_txbytes(hdr, sizeof(hdr));
+	usbcomm_txbytes((uint8_t *)data, len);
+	usbcomm_txbyte(crc);
+	usbcomm_txbyte(crc >> 8);
+}
+
+/* Text commands write here instead of to the serial port */
+static int rpc_putchar(char c, FILE *stream)
+{
+	OUT_BUF[s_outlen++] = c;
+	if (s_outlen == OUT_CHUNK) {
+		sendReply(RPC_STATUS_MORE, OUT_BUF, s_outlen);
+		s_outlen = 0;
+	}
+	return 1;
+}
+
+static FILE rpc_stdout = FDEV_SETUP_STREAM(rpc_putchar, NULL, _FDEV_SETUP_WRITE);
+
+/* Commands which write to the serial port directly (transfers, trace,
+ * raw benchmark data), run long or never return. Prefixes, matched like
+ * the menu does (so "ux" also covers "uxe"). */
+static const char denied_commands[] PROGMEM =
+	"dx\0ux\0dz\0uz\0us\0trace\0tune\0bench\0boot\0reset\0";
+
+static uint8_t commandDenied(const uint8_t *line)
+{
+	PGM_P cmd;
+
+	for (cmd = denied_commands; pgm_read_byte(cmd); cmd += strlen_P(cmd) + 1) {
+		if (strncmp_P((const char *)line, cmd, strlen_P(cmd)) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void runCommand(uint8_t *line, uint8_t len)
+{
+	FILE *saved = stdout;
+
+	// Overwrites the CRC, already checked
+	line[len] = 0;
+
+	if (commandDenied(line)) {
+		sendReply(RPC_STATUS_ERR_REFUSED, NULL, 0);
+		return;
+	}
+
+	s_outlen = 0;
+	stdout = &rpc_stdout;
+	menu_runCommand(line, len);
+	stdout = saved;
+
+	sendReply(RPC_STATUS_OK, OUT_BUF, s_outlen);
+}
+
+static void readRom(uint32_t rom_addr, uint32_t len)
+{
+	uint8_t n;
+
+	flash_waitIdle();
+
+	while (len) {
+		n = OUT_CHUNK;
+		if (len < n) {
+			n = len;
+		}
+		// Stay in the same 16K bank
+		if (n > 0x4000 - (rom_addr & 0x3FFF)) {
+			n = 0x4000 - (rom_addr & 0x3FFF);
+		}
+
+		mapper_readRomPlanned(rom_addr, n, OUT_BUF);
+		sendReply(RPC_STATUS_MORE, OUT_BUF, n);
+
+		rom_addr += n;
+		len -= n;
+	}
+
+	mapper_resetSlots();
+	sendReply(RPC_STATUS_OK, NULL, 0);
+}
+
+static void handleFrame(void)
+{
+	uint8_t len = s_frame[2];
+	uint8_t *payload = s_frame + FRAME_HEADER_SIZE;
+	uint8_t ping[3] = { RPC_PROTOCOL_VERSION, VERSIONBCD & 0xff, VERSIONBCD >> 8 };
+	struct rpc_info info;
+	uint32_t addr = 0, count;
+	uint16_t crc = 0;
+	uint8_t i;
+
+	if (len > RPC_MAX_PAYLOAD) {
+		sendReply(RPC_STATUS_ERR_ARGS, NULL, 0);
+		return;
+	}
+
+	for (i=0; i<FRAME_HEADER_SIZE + len; i++) {
+		crc = _crc_xmodem_update(crc, s_frame[i]);
+	}
+	if (crc != (payload[len] | (payload[len+1] << 8))) {
+		sendReply(RPC_STATUS_ERR_CRC, NULL, 0);
+		return;
+	}
+
+	if (len >= 4) {
+		memcpy(&addr, payload, 4);
+	}
+
+	switch (s_frame[0])
+	{
+		case RPC_OP_PING:
+			sendReply(RPC_STATUS_OK, ping, sizeof(ping));
+			return;
+
+		case RPC_OP_COMMAND:
+			runCommand(payload, len);
+			return;
+
+		case RPC_OP_INFO:
+			info.rom_size = menu_getRomSize();
+			info.flash_size = menu_getFlashSize();
+			info.mapper_type = mapper_getCurrentType();
+			sendReply(RPC_STATUS_OK, (uint8_t *)&info, sizeof(info));
+			return;
+
+		case RPC_OP_READ:
+			if (len != 8)
+				break;
+			memcpy(&count, payload + 4, 4);
+			readRom(addr, count);
+			return;
+
+		case RPC_OP_PROGRAM:
+			if (len <= 4 || (addr & 0x3FFF) + len - 4 > 0x4000)
+				break;
+			// A new upload, of unknown size
+			if (addr == 0 && !s_upload_begun) {
+				flash_jitEraseReset(0);
+				flash_crcBegin();
+			}
+			s_upload_begun = 0;
+			flash_programRomJit(addr, payload + 4, len - 4);
+			mapper_resetSlots();
+			sendReply(RPC_STATUS_OK, NULL, 0);
+			return;
+
+		case RPC_OP_PROGRAM_BEGIN:
+			if (len != 4)
+				break;
+			flash_jitEraseReset(addr);
+			flash_crcBegin();
+			s_upload_begun = 1;
+			sendReply(RPC_STATUS_OK, NULL, 0);
+			return;
+
+		case RPC_OP_ERASE_SECTOR:
+			if (len != 4)
+				break;
+			flash_eraseSector(addr);
+			mapper_resetSlots();
+			sendReply(RPC_STATUS_OK, NULL, 0);
+			return;
+
+		default:
+			sendReply(RPC_STATUS_ERR_OP, NULL, 0);
+			return;
+	}
+
+	sendReply(RPC_STATUS_ERR_ARGS, NULL, 0);
+}
+
+uint8_t rpc_handleByte(uint8_t b, uint8_t line_start)
+{
+	uint32_t now = timer_getTicks();
+
+	// Give up on a partial frame, so the console is usable again
+	if (s_in_frame && now - s_last_ticks > RPC_TIMEOUT_MS * TIMER_TICKS_PER_MS) {
+		s_in_frame = 0;
+	}
+	s_last_ticks = now;
+
+	if (!s_in_frame) {
+		if (b != RPC_SYNC || !line_start)
+			return 0;
+		s_in_frame = 1;
+		s_pos = 0;
+		s_frame = menu_getPacketBuffer();
+		return 1;
+	}
+
+	// An oversized payload is not stored, only counted
+	if (s_pos < FRAME_MAX_SIZE) {
+		s_frame[s_pos] = b;
+	}
+	s_pos++;
+
+	if (s_pos >= FRAME_HEADER_SIZE && s_pos == FRAME_HEADER_SIZE + s_frame[2] + 2) {
+		s_in_frame = 0;
+		handleFrame();
+	}
+
+	return 1;
+}
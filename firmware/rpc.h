@@ -0,0 +1,74 @@
+#ifndef _rpc_h__
+#define _rpc_h__
+
+#include <stdint.h>
+
+/* Binary command frames on the serial port, for programs. A frame starts
+ * with RPC_SYNC at the beginning of a line (text commands never contain
+ * this byte), is not echoed and gets framed replies without a prompt.
+ * Requests are handled in the order received, so several can be sent
+ * without waiting for the replies, which carry the same request ID.
+ *
+ * Request : RPC_SYNC, opcode, request ID, length, payload, CRC
+ * Reply   : RPC_REPLY_SYNC, opcode, request ID, status, length, payload, CRC
+ *
+ * The CRC is a CRC-16 (XMODEM) of everything after the sync byte. All
+ * multi-byte values are little endian. A request can get several replies:
+ * All but the last have status RPC_STATUS_MORE.
+ *
+ * RPC_OP_PING         : Reply: protocol version, firmware version (BCD, 2 bytes)
+ * RPC_OP_COMMAND      : Payload: a text command. Replies: its output.
+ *                       Commands which use the serial port directly
+ *                       (dx, ux, trace...) get RPC_STATUS_ERR_REFUSED.
+ * RPC_OP_INFO         : Reply: struct rpc_info (run init first)
+ * RPC_OP_READ         : Payload: ROM address, length (4 bytes each).
+ *                       Replies: the data.
+ * RPC_OP_PROGRAM      : Payload: ROM address (4 bytes), then up to
+ *                       RPC_MAX_DATA bytes to program, not crossing a 16K
+ *                       bank boundary. Sectors are erased when first
+ *                       written to, so program in ascending order starting
+ *                       at address 0.
+ * RPC_OP_PROGRAM_BEGIN: Payload: image size (4 bytes). Starts an upload,
+ *                       sectors past the image are never erased ahead.
+ *                       Without it, programming address 0 starts an upload
+ *                       of unknown size.
+ * RPC_OP_ERASE_SECTOR : Payload: ROM address (4 bytes)
+ *
+ * A partial request is dropped after RPC_TIMEOUT_MS without data.
+ */
+
+#define RPC_SYNC			0xA5
+#define RPC_REPLY_SYNC		0xA6
+
+#define RPC_PROTOCOL_VERSION	2
+#define RPC_MAX_DATA		64
+#define RPC_MAX_PAYLOAD		(4 + RPC_MAX_DATA)
+#define RPC_TIMEOUT_MS		100
+
+#define RPC_OP_PING			0x00
+#define RPC_OP_COMMAND		0x01
+#define RPC_OP_INFO			0x02
+#define RPC_OP_READ			0x03
+#define RPC_OP_PROGRAM		0x04
+#define RPC_OP_ERASE_SECTOR	0x05
+#define RPC_OP_PROGRAM_BEGIN	0x06
+
+#define RPC_STATUS_OK		0x00
+#define RPC_STATUS_MORE		0x01
+#define RPC_STATUS_ERR_CRC	0x80
+#define RPC_STATUS_ERR_OP	0x81
+#define RPC_STATUS_ERR_ARGS	0x82
+#define RPC_STATUS_ERR_REFUSED	0x83
+
+struct rpc_info {
+	uint32_t rom_size;
+	uint32_t flash_size;	// 0 if not a flash cartridge
+	uint8_t mapper_type;	// MAPPER_TYPE_*
+};
+
+/* Give a received byte to the frame decoder. Returns 0 if it is not part
+ * of a frame (text command). line_start must be non-zero when no text
+ * command has been started. */
+uint8_t rpc_handleByte(uint8_t b, uint8_t line_start);
+
+#endif // _rpc_h__
@@ -0,0 +1,118 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "stats.h"
+#include "timer.h"
+
+#ifdef STATS_ENABLED
+
+volatile uint8_t g_stats_phase;
+volatile uint32_t g_stats_samples[STATS_NUM_PHASES];
+uint32_t g_stats_counters[STATS_NUM_COUNTERS];
+
+static const char phase_other[] PROGMEM = "other";
+static const char phase_addr[] PROGMEM = "address latch";
+static const char phase_read[] PROGMEM = "bus read";
+static const char phase_write[] PROGMEM = "bus write";
+static const char phase_poll[] PROGMEM = "flash poll";
+static const char phase_usbtx[] PROGMEM = "usb tx wait";
+static const char phase_host[] PROGMEM = "host wait";
+
+static PGM_P const phase_names[STATS_NUM_PHASES] PROGMEM = {
+	[STATS_PH_OTHER] = phase_other,
+	[STATS_PH_ADDR_LATCH] = phase_addr,
+	[STATS_PH_BUS_READ] = phase_read,
+	[STATS_PH_BUS_WRITE] = phase_write,
+	[STATS_PH_FLASH_POLL] = phase_poll,
+	[STATS_PH_USB_TX] = phase_usbtx,
+	[STATS_PH_HOST_WAIT] = phase_host,
+};
+
+static const char cnt_read[] PROGMEM = "bytes read";
+static const char cnt_programmed[] PROGMEM = "bytes programmed";
+static const char cnt_tx[] PROGMEM = "bytes sent";
+static const char cnt_rx[] PROGMEM = "bytes received";
+static const char cnt_naks[] PROGMEM = "naks";
+static const char cnt_retransmits[] PROGMEM = "retransmits";
+static const char cnt_timeouts[] PROGMEM = "timeouts";
+
+static PGM_P const counter_names[STATS_NUM_COUNTERS] PROGMEM = {
+	[STATS_CNT_BYTES_READ] = cnt_read,
+	[STATS_CNT_BYTES_PROGRAMMED] = cnt_programmed,
+	[STATS_CNT_BYTES_TX] = cnt_tx,
+	[STATS_CNT_BYTES_RX] = cnt_rx,
+	[STATS_CNT_NAKS] = cnt_naks,
+	[STATS_CNT_RETRANSMITS] = cnt_retransmits,
+	[STATS_CNT_TIMEOUTS] = cnt_timeouts,
+};
+
+void stats_reset(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	memset((void*)g_stats_samples, 0, sizeof(g_stats_samples));
+	SREG = sreg;
+
+	memset(g_stats_counters, 0, sizeof(g_stats_counters));
+}
+
+void stats_print(void)
+{
+	uint32_t samples[STATS_NUM_PHASES];
+	uint32_t total = 0;
+	uint8_t sreg = SREG;
+	uint8_t i;
+
+	cli();
+	memcpy(samples, (void*)g_stats_samples, sizeof(samples));
+	SREG = sreg;
+
+	for (i=0; i<STATS_NUM_PHASES; i++) {
+		total += samples[i];
+	}
+
+	printf_P(PSTR("Elapsed: %lu ms\n"), total / TIMER_TICKS_PER_MS);
+	// For percentages
+	total /= 100;
+	for (i=0; i<STATS_NUM_PHASES; i++) {
+		printf_P(PSTR("  %-16S %10lu ms  %3u%%\n"), (PGM_P)pgm_read_word(&phase_names[i]),
+				samples[i] / TIMER_TICKS_PER_MS,
+				total ? (uint16_t)(samples[i] / total) : 0);
+	}
+
+	for (i=0; i<STATS_NUM_COUNTERS; i++) {
+		printf_P(PSTR("  %-16S %10lu\n"), (PGM_P)pgm_read_word(&counter_names[i]), g_stats_counters[i]);
+	}
+}
+
+#else
+
+void stats_reset(void)
+{
+}
+
+void stats_print(void)
+{
+	puts_P(PSTR("Statistics not compiled in"));
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _stats_h__
+#define _stats_h__
+
+#include <stdint.h>
+
+/* Comment out to remove the performance counters and the
+ * instrumentation code. Left out of trace builds (see trace.h). */
+#ifndef TRACE_ENABLED
+#define STATS_ENABLED
+#endif
+
+/* Time is accounted by sampling: instrumented code sets the current
+ * phase and the timer tick interrupt charges one tick to it. This keeps
+ * the cost of an instrumented section to a few cycles. */
+enum {
+	STATS_PH_OTHER = 0,		// Not in any of the phases below
+	STATS_PH_ADDR_LATCH,	// setCartAddress
+	STATS_PH_BUS_READ,		// cartRead, cartReadSequential (with its address latching)
+	STATS_PH_BUS_WRITE,		// cartWrite, cartWriteClk
+	STATS_PH_FLASH_POLL,	// Waiting for program/erase completion (including the reads)
+	STATS_PH_USB_TX,		// Waiting for (and filling) an IN endpoint
+	STATS_PH_HOST_WAIT,		// Waiting for the host (acknowledgements, data)
+	STATS_NUM_PHASES
+};
+
+enum {
+	STATS_CNT_BYTES_READ = 0,	// ROM bytes read for transfers
+	STATS_CNT_BYTES_PROGRAMMED,
+	STATS_CNT_BYTES_TX,			// Bytes queued on IN endpoints
+	STATS_CNT_BYTES_RX,			// Bytes received on the serial port
+	STATS_CNT_NAKS,				// Transfer errors reported (XMODEM NAK, ZMODEM ZRPOS)
+	STATS_CNT_RETRANSMITS,
+	STATS_CNT_TIMEOUTS,
+	STATS_NUM_COUNTERS
+};
+
+#ifdef STATS_ENABLED
+
+extern volatile uint8_t g_stats_phase;
+extern volatile uint32_t g_stats_samples[STATS_NUM_PHASES];
+extern uint32_t g_stats_counters[STATS_NUM_COUNTERS];
+
+/* Enter a phase. Returns the previous phase, to be restored with
+ * stats_phaseEnd(). */
+static inline uint8_t stats_phaseBegin(uint8_t phase)
+{
+	uint8_t prev = g_stats_phase;
+
+	// The reads done while polling the flash count as polling
+	if (prev != STATS_PH_FLASH_POLL) {
+		g_stats_phase = phase;
+	}
+
+	return prev;
+}
+
+static inline void stats_phaseEnd(uint8_t prev)
+{
+	g_stats_phase = prev;
+}
+
+static inline void stats_count(uint8_t counter, uint16_t n)
+{
+	g_stats_counters[counter] += n;
+}
+
+// Called from the timer interrupt
+#define STATS_SAMPLE()	g_stats_samples[g_stats_phase]++
+
+#else
+
+static inline uint8_t stats_phaseBegin(uint8_t phase) { return 0; }
+static inline void stats_phaseEnd(uint8_t prev) { }
+static inline void stats_count(uint8_t counter, uint16_t n) { }
+
+#define STATS_SAMPLE()
+
+#endif
+
+void stats_reset(void);
+void stats_print(void);
+
+#endif // _stats_h__
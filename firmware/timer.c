@@ -0,0 +1,78 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "timer.h"
+#include "stats.h"
+
+static volatile uint32_t s_ticks;
+
+ISR(TIMER1_COMPA_vect)
+{
+	s_ticks++;
+	STATS_SAMPLE();
+}
+
+void timer_init(void)
+{
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TCNT1 = 0;
+	OCR1A = TIMER_TICK_CYCLES - 1;
+	s_ticks = 0;
+
+	// CTC mode (top = OCR1A), no prescaler
+	TIFR1 = (1<<OCF1A);
+	TIMSK1 = (1<<OCIE1A);
+	TCCR1B = (1<<WGM12) | (1<<CS10);
+}
+
+void timer_shutdown(void)
+{
+	TIMSK1 = 0;
+	TCCR1B = 0;
+}
+
+uint32_t timer_getTicks(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t t;
+
+	cli();
+	t = s_ticks;
+	SREG = sreg;
+
+	return t;
+}
+
+uint32_t timer_getCycles(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t t;
+	uint16_t c;
+
+	cli();
+	t = s_ticks;
+	c = TCNT1;
+	// The counter may have wrapped after interrupts were disabled
+	if ((TIFR1 & (1<<OCF1A)) && c < TIMER_TICK_CYCLES / 2) {
+		t++;
+	}
+	SREG = sreg;
+
+	return t * TIMER_TICK_CYCLES + c;
+}
@@ -0,0 +1,23 @@
+#ifndef _timer_h__
+#define _timer_h__
+
+#include <stdint.h>
+
+/* Timer1 generates a tick every TIMER_TICK_CYCLES CPU cycles (1ms at
+ * 16 MHz). The tick interrupt also samples the performance counters
+ * (see stats.h). Finer times come from the counter itself, see
+ * timer_getCycles(). */
+#define TIMER_TICK_CYCLES	16000
+#define TIMER_TICKS_PER_MS	(F_CPU / 1000 / TIMER_TICK_CYCLES)
+
+void timer_init(void);
+void timer_shutdown(void);
+
+/* Ticks since timer_init() */
+uint32_t timer_getTicks(void);
+
+/* CPU cycles since timer_init(). Wraps after about 4 minutes, so only
+ * use differences. */
+uint32_t timer_getCycles(void);
+
+#endif // _timer_h__
@@ -0,0 +1,118 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include "trace.h"
+#include "timer.h"
+#include "usbcomm.h"
+
+#ifdef TRACE_ENABLED
+
+struct trace_record {
+	uint8_t time[3];	// Event in the top 4 bits
+	uint16_t arg;
+};
+
+static struct trace_record s_ring[TRACE_RECORDS];
+static uint8_t s_head; // Next record to write
+static uint8_t s_count;
+// Set while dumping, so the dump does not trace itself
+static volatile uint8_t s_paused;
+
+static void putTime(uint8_t *dst, uint32_t t)
+{
+	dst[0] = t;
+	dst[1] = t >> 8;
+	dst[2] = t >> 16;
+}
+
+static uint32_t traceTime(void)
+{
+	return (timer_getCycles() >> TRACE_TIME_SHIFT) & ((1UL << TRACE_TIME_BITS) - 1);
+}
+
+void trace_add(uint8_t event, uint16_t arg)
+{
+	uint8_t sreg = SREG;
+	struct trace_record *r;
+
+	cli();
+
+	if (!s_paused) {
+		r = &s_ring[s_head];
+		putTime(r->time, traceTime() | (uint32_t)event << TRACE_TIME_BITS);
+		r->arg = arg;
+
+		s_head = (s_head + 1) & (TRACE_RECORDS - 1);
+		if (s_count < TRACE_RECORDS) {
+			s_count++;
+		}
+	}
+
+	SREG = sreg;
+}
+
+void trace_clear(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	s_head = 0;
+	s_count = 0;
+	SREG = sreg;
+}
+
+void trace_dump(void)
+{
+	uint8_t hdr[9] = { 'T', 'R', 'C', TRACE_FORMAT_VERSION };
+	uint8_t i, pos;
+
+	s_paused = 1;
+
+	hdr[4] = s_count;
+	hdr[5] = sizeof(struct trace_record);
+	putTime(hdr + 6, traceTime());
+	usbcomm_txbytes(hdr, sizeof(hdr));
+
+	pos = (s_head - s_count) & (TRACE_RECORDS - 1);
+	for (i=0; i<s_count; i++) {
+		usbcomm_txbytes((uint8_t*)&s_ring[pos], sizeof(struct trace_record));
+		pos = (pos + 1) & (TRACE_RECORDS - 1);
+	}
+
+	usbcomm_drain();
+
+	s_paused = 0;
+}
+
+#else
+
+void trace_clear(void)
+{
+}
+
+void trace_dump(void)
+{
+	uint8_t hdr[9] = { 'T', 'R', 'C', TRACE_FORMAT_VERSION };
+
+	usbcomm_txbytes(hdr, sizeof(hdr));
+	usbcomm_drain();
+}
+
+#endif
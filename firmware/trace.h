@@ -0,0 +1,61 @@
+#ifndef _trace_h__
+#define _trace_h__
+
+#include <stdint.h>
+
+/* The event trace is left out unless the firmware is built with
+ * make TRACE=1 (defines TRACE_ENABLED). There is no room for it next to
+ * the statistics, which trace builds leave out (see stats.h). */
+
+/* Number of records kept (power of two), 5 bytes of SRAM each */
+#define TRACE_RECORDS		16
+
+/* Timestamps are in units of 2^TRACE_TIME_SHIFT CPU cycles
+ * (4us at 16 MHz) and wrap after TRACE_TIME_BITS (about 4 seconds). */
+#define TRACE_TIME_SHIFT	6
+#define TRACE_TIME_BITS		20
+
+/* Dump format (see client/tracedecode.py), multi-byte values little endian:
+ *
+ *   "TRC" TRACE_FORMAT_VERSION
+ *   record count (1 byte), record size (1 byte), time of the dump (3 bytes)
+ *   records, oldest first: time | event << TRACE_TIME_BITS (3 bytes),
+ *   argument (2 bytes)
+ *
+ * Without the trace, the header alone is sent with a record size of 0.
+ */
+#define TRACE_FORMAT_VERSION	2
+
+// At most 15, see the record format above
+enum {
+	TRACE_EV_NONE = 0,
+	TRACE_EV_XMODEM_STATE,	// arg: new state | packet number << 8 (upload)
+	TRACE_EV_XMODEM_BLOCK,	// arg: packet number (block sent)
+	TRACE_EV_XMODEM_ACK,	// arg: packet number
+	TRACE_EV_XMODEM_NAK,	// arg: packet number
+	TRACE_EV_MAPPER_SLOT,	// arg: slot << 8 | bank
+	TRACE_EV_FLASH_PROGRAM,	// arg: cartridge address
+	TRACE_EV_FLASH_ERASE,	// arg: sector ROM address / 8K, 0xFFFF for the whole chip
+	TRACE_EV_FLASH_DONE,	// arg: bytes programmed (0 for an erase)
+	TRACE_EV_USB_TX,		// arg: endpoint << 8 | size (packet handed to the USB controller)
+	TRACE_EV_RX_HIGHWATER,	// arg: bytes in the receive buffer
+	TRACE_EV_RX_FULL,		// arg: size of the packet held back
+};
+
+#ifdef TRACE_ENABLED
+
+/* Can be called from interrupts */
+void trace_add(uint8_t event, uint16_t arg);
+
+#else
+
+static inline void trace_add(uint8_t event, uint16_t arg) { }
+
+#endif
+
+void trace_clear(void);
+
+/* Send the ring in binary (format above) */
+void trace_dump(void);
+
+#endif // _trace_h__
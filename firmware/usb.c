@@ -30,6 +30,8 @@
 #include <util/delay.h>
 
 #include "usb.h"
+#include "stats.h"
+#include "trace.h"
 
 #define STATE_POWERED		0
 #define STATE_DEFAULT		1
@@ -44,14 +46,20 @@ static uint8_t g_current_config;
 static const void *interrupt_data[NUM_USB_ENDPOINTS];
 static volatile int interrupt_data_len[NUM_USB_ENDPOINTS];
 
-#define CONTROL_WRITE_BUFSIZE	64
+// Enough for SET_LINE_CODING (7 bytes), the only data stage used
+#define CONTROL_WRITE_BUFSIZE	8
 static struct usb_request control_write_rq;
 static volatile uint16_t control_write_len;
 static volatile uint8_t control_write_in_progress;
 static uint8_t control_write_buf[CONTROL_WRITE_BUFSIZE];
 
+// In program memory, read with the PARAM_ macros
 static const struct usb_parameters *g_params;
 
+#define PARAM_BYTE(field)	pgm_read_byte(&g_params->field)
+#define PARAM_WORD(field)	pgm_read_word(&g_params->field)
+#define PARAM_PTR(field)	((void *)pgm_read_word(&g_params->field))
+
 static void initControlWrite(const struct usb_request *rq)
 {
 	memcpy(&control_write_rq, rq, sizeof(struct usb_request));
@@ -59,23 +67,25 @@ static void initControlWrite(const struct usb_request *rq)
 	control_write_in_progress = 1;
 }
 
-static int wcslen(const wchar_t *str)
+static int wcslen(const wchar_t *str, uint8_t progmem)
 {
 	int i=0;
-	while (*str) {
+	while (progmem ? pgm_read_word(str) : *str) {
 		str++;
 		i++;
 	}
 	return i;
 }
 
-static char allocEndpoint(uint8_t number, uint8_t type, uint8_t epsize, uint8_t ints)
+static char allocEndpoint(uint8_t number, uint8_t type, uint8_t epsize, uint8_t flags, uint8_t ints)
 {
+	uint8_t banks = (flags & EP_FLAG_DUAL_BANK) ? 1 : 0;
+
 	UENUM = number;
 	UECONX = 1<<EPEN; // activate endpoint
 	UECFG0X = type;
 	UEIENX = ints;
-	UECFG1X = (epsize<<EPSIZE0) | (1<<ALLOC);
+	UECFG1X = (epsize<<EPSIZE0) | (banks<<EPBK0) | (1<<ALLOC);
 	UEINTX = 0;
 
 	if (!(UESTA0X & (1<<CFGOK))) {
@@ -88,7 +98,7 @@ static char allocEndpoint(uint8_t number, uint8_t type, uint8_t epsize, uint8_t
 
 static uint8_t getEndpointSize(uint8_t epnum)
 {
-	uint8_t eps = g_params->epconfigs[epnum].size;
+	uint8_t eps = PARAM_BYTE(epconfigs[epnum].size);
 
 
 	if (eps == 1)
@@ -105,25 +115,26 @@ static char setupEndpoints(void)
 {
 	int i;
 	int r = 0;
-	const struct usb_ep_cfg *epcfg = g_params->epconfigs;
+	struct usb_ep_cfg epcfg;
 
 	for (i=0; i<NUM_USB_ENDPOINTS; i++)
 	{
 		interrupt_data[i] = NULL;
 		interrupt_data_len[i] = -1;
 
-		if (epcfg[i].enabled) {
+		memcpy_P(&epcfg, &g_params->epconfigs[i], sizeof(epcfg));
+		if (epcfg.enabled) {
 			uint8_t ints;
 
 			if (i==0) {
 				ints = (1<<RXSTPE) | (1<<RXOUTE);
-			} else if ((epcfg[i].type & 1) == EP_TYPE_IN) {
+			} else if ((epcfg.type & 1) == EP_TYPE_IN) {
 				ints = (1<<TXINE);
 			} else {
 				ints = (1 << RXOUTE);
 			}
 
-			r += allocEndpoint(i, epcfg[i].type, epcfg[i].size, ints);
+			r += allocEndpoint(i, epcfg.type, epcfg.size, epcfg.flags, ints);
 		}
 	}
 
@@ -184,8 +195,16 @@ static uint16_t readEP2buf(uint8_t *dst)
 	return len;
 }
 
+// Bytes already in the EP0 bank for the current control read
+static uint8_t ep0_count;
+// Set when the host ends the data stage early (status OUT received)
+static uint8_t ep0_aborted;
+
 static void buf2EP(uint8_t epnum, const void *src, uint16_t len, uint16_t max_len, uint8_t progmem)
 {
+	const unsigned char *s = src;
+	uint8_t epsize;
+	uint8_t b;
 	int i;
 
 
@@ -195,18 +214,33 @@ static void buf2EP(uint8_t epnum, const void *src, uint16_t len, uint16_t max_le
 		len = max_len;
 	}
 
-	if (progmem) {
-		const unsigned char *s = src;
+	if (epnum != 0) {
 		for (i=0; i<len; i++) {
-			UEDATX = pgm_read_byte(s);
+			UEDATX = progmem ? pgm_read_byte(s) : *s;
 			s++;
 		}
-	} else {
-		const unsigned char *s = src;
-		for (i=0; i<len; i++) {
-			UEDATX = *s;
-			s++;
+		return;
+	}
+
+	// The control endpoint is small, so send full packets as they
+	// fill up. The last (partial) packet is sent by the caller.
+	epsize = getEndpointSize(0);
+
+	for (i=0; i<len && !ep0_aborted; i++) {
+		if (ep0_count == epsize) {
+			UEINTX &= ~(1<<TXINI);
+			while (!(UEINTX & ((1<<TXINI)|(1<<RXOUTI))));
+			if (UEINTX & (1<<RXOUTI)) {
+				ep0_aborted = 1;
+				break;
+			}
+			ep0_count = 0;
 		}
+
+		b = progmem ? pgm_read_byte(s) : *s;
+		UEDATX = b;
+		s++;
+		ep0_count++;
 	}
 }
 
@@ -214,28 +248,8 @@ static void buf2EP(uint8_t epnum, const void *src, uint16_t len, uint16_t max_le
  */
 static void longDescriptorHelper(const uint8_t *data, uint16_t len, uint16_t rq_len, uint8_t progmem)
 {
-	uint16_t todo = rq_len > len ? len : rq_len;
-	uint16_t pos = 0;
-	uint8_t epsize = getEndpointSize(0);
-
-	while(1)
-	{
-		if (todo > epsize) {
-			buf2EP(0, data+pos, epsize, epsize, progmem);
-			UEINTX &= ~(1<<TXINI);
-			pos += epsize;
-			todo -= epsize;
-			while (!(UEINTX & (1<<TXINI)));
-		}
-		else {
-			buf2EP(0, data+pos, todo,
-					todo,
-					progmem);
-			UEINTX &= ~(1<<TXINI);
-			while (!(UEINTX & (1<<TXINI)));
-			break;
-		}
-	}
+	// buf2EP() takes care of splitting the data in packets
+	buf2EP(0, data, len, rq_len, progmem);
 }
 
 static void setupCbAnswer(const void *src, uint16_t len, uint8_t is_pgmspace)
@@ -248,6 +262,9 @@ static void handleSetupPacket(struct usb_request *rq)
 	char unhandled = 0;
 	char res;
 
+	ep0_count = 0;
+	ep0_aborted = 0;
+
 	if (USB_RQT_IS_HOST_TO_DEVICE(rq->bmRequestType))
 	{
 		switch (rq->bmRequestType & USB_RQT_RECIPIENT_MASK)
@@ -356,16 +373,16 @@ static void handleSetupPacket(struct usb_request *rq)
 						switch (rq->wValue >> 8)
 						{
 							case DEVICE_DESCRIPTOR:
-								buf2EP(0, (unsigned char*)g_params->devdesc,
+								buf2EP(0, PARAM_PTR(devdesc),
 										sizeof(struct usb_device_descriptor), rq->wLength,
-										g_params->flags & USB_PARAM_FLAG_DEVDESC_PROGMEM);
+										PARAM_BYTE(flags) & USB_PARAM_FLAG_DEVDESC_PROGMEM);
 								break;
 							case CONFIGURATION_DESCRIPTOR:
 								// Check index if more than 1 config
-								longDescriptorHelper(g_params->configdesc,
-													g_params->configdesc_ttllen,
+								longDescriptorHelper(PARAM_PTR(configdesc),
+													PARAM_WORD(configdesc_ttllen),
 													rq->wLength,
-													g_params->flags & USB_PARAM_FLAG_CONFDESC_PROGMEM);
+													PARAM_BYTE(flags) & USB_PARAM_FLAG_CONFDESC_PROGMEM);
 
 
 								break;
@@ -373,21 +390,25 @@ static void handleSetupPacket(struct usb_request *rq)
 								{
 									int id, len, slen;
 									struct usb_string_descriptor_header hdr;
+									const wchar_t *const *strings = PARAM_PTR(strings);
+									const wchar_t *str;
+									uint8_t progmem = PARAM_BYTE(flags) & USB_PARAM_FLAG_STRINGS_PROGMEM;
 
 									id = (rq->wValue & 0xff);
-									if (id > 0 && id <= g_params->num_strings)
+									if (id > 0 && id <= PARAM_BYTE(num_strings))
 									{
 										id -= 1; // Our string table is zero-based
 
+										str = progmem ? (const wchar_t *)pgm_read_word(&strings[id]) : strings[id];
 										len = rq->wLength;
-										slen = wcslen(g_params->strings[id]) << 1;
+										slen = wcslen(str, progmem) << 1;
 
 										hdr.bLength = sizeof(hdr) + slen;
 										hdr.bDescriptorType = STRING_DESCRIPTOR;
 
 										buf2EP(0, (unsigned char*)&hdr, 2, len, 0);
 										len -= 2;
-										buf2EP(0, (unsigned char*)g_params->strings[id], slen, len, 0);
+										buf2EP(0, (unsigned char*)str, slen, len, progmem);
 									}
 									else if (id == 0) // Table of supported languages (string id 0)
 									{
@@ -440,15 +461,15 @@ static void handleSetupPacket(struct usb_request *rq)
 										{
 											// HID 1.1 : 7.1.1 Get_Descriptor request. wIndex is the interface number.
 											//
-											if (rq->wIndex > g_params->n_hid_interfaces) {
+											if (rq->wIndex > PARAM_BYTE(n_hid_interfaces)) {
 												unhandled = 1;
 												break;
 											}
 
-											longDescriptorHelper(g_params->hid_params[rq->wIndex].reportdesc,
-																g_params->hid_params[rq->wIndex].reportdesc_len,
+											longDescriptorHelper(PARAM_PTR(hid_params[rq->wIndex].reportdesc),
+																PARAM_WORD(hid_params[rq->wIndex].reportdesc_len),
 																rq->wLength,
-																g_params->flags & USB_PARAM_FLAG_REPORTDESC_PROGMEM);
+																PARAM_BYTE(flags) & USB_PARAM_FLAG_REPORTDESC_PROGMEM);
 
 										}
 										break;
@@ -469,13 +490,16 @@ static void handleSetupPacket(struct usb_request *rq)
 							case HID_CLSRQ_GET_REPORT:
 								{
 									// HID 1.1 : 7.2.1 Get_Report request. wIndex is the interface number.
-									if (rq->wIndex > g_params->n_hid_interfaces)
+									uint16_t (*getReport)(struct usb_request *rq, const uint8_t **dat);
+
+									if (rq->wIndex > PARAM_BYTE(n_hid_interfaces))
 										break;
 
-									if (g_params->hid_params[rq->wIndex].getReport) {
+									getReport = PARAM_PTR(hid_params[rq->wIndex].getReport);
+									if (getReport) {
 										const unsigned char *data;
 										uint16_t len;
-										len = g_params->hid_params[rq->wIndex].getReport(rq, &data);
+										len = getReport(rq, &data);
 										if (len) {
 											buf2EP(0, data, len, rq->wLength, 0);
 										}
@@ -535,9 +559,12 @@ static void handleSetupPacket(struct usb_request *rq)
 	} // IS DEVICE-TO-HOST
 
 	if (unhandled) {
-		if (g_params->setupCb)
+		uint8_t (*setupCb)(const struct usb_request *rq, void (*answerFunc)(const void *src, uint16_t len, uint8_t is_pgmspace));
+
+		setupCb = PARAM_PTR(setupCb);
+		if (setupCb)
 		{
-			res = g_params->setupCb(rq, setupCbAnswer);
+			res = setupCb(rq, setupCbAnswer);
 
 			if (res) {
 
@@ -545,6 +572,11 @@ static void handleSetupPacket(struct usb_request *rq)
 				if (res == -1) {
 					initControlWrite(rq);
 				}
+				else if (USB_RQT_IS_HOST_TO_DEVICE(rq->bmRequestType))
+				{
+					// No data stage. Send the status stage (ZLP)
+					UEINTX &= ~(1<<TXINI);
+				}
 				else
 				{
 					// Handle transmission now
@@ -579,11 +611,14 @@ static void handleDataPacket(const struct usb_request *rq, uint8_t *dat, uint16_
 
 		// HID 1.1 : 7.2.2 Set_Report request. wIndex is the interface number.
 
-		if (rq->wIndex > g_params->n_hid_interfaces)
+		uint8_t (*setReport)(const struct usb_request *rq, const uint8_t *dat, uint16_t len);
+
+		if (rq->wIndex > PARAM_BYTE(n_hid_interfaces))
 			return;
 
-		if (g_params->hid_params[rq->wIndex].setReport) {
-			if (g_params->hid_params[rq->wIndex].setReport(rq, dat, len)) {
+		setReport = PARAM_PTR(hid_params[rq->wIndex].setReport);
+		if (setReport) {
+			if (setReport(rq, dat, len)) {
 				UECONX |= (1<<STALLRQ);
 			} else {
 				// xmit status
@@ -595,14 +630,13 @@ static void handleDataPacket(const struct usb_request *rq, uint8_t *dat, uint16_
 
 	if ((rq->bmRequestType & (USB_RQT_TYPE_MASK)) == USB_RQT_VENDOR) {
 
-		if (g_params->handleDataPacket) {
-			if (g_params->handleDataPacket(rq, dat, len)) {
-				UECONX |= (1<<STALLRQ);
-			} else {
-				// xmit status
-				UEINTX &= ~(1<<TXINI);
-				while (!(UEINTX & (1<<TXINI)));
-			}
+		uint8_t (*handleDataPacket)(const struct usb_request *rq, const uint8_t *dat, uint16_t len);
+
+		handleDataPacket = PARAM_PTR(handleDataPacket);
+		if (handleDataPacket) {
+			// The status stage was sent before calling
+			// this, so errors cannot be reported here.
+			handleDataPacket(rq, dat, len);
 			return;
 		}
 	}
@@ -679,7 +713,7 @@ ISR(USB_COM_vect)
 			len = getEPlen();
 
 			if (control_write_in_progress) {
-				if (control_write_len + len < CONTROL_WRITE_BUFSIZE) {
+				if (control_write_len + len <= CONTROL_WRITE_BUFSIZE) {
 					readEP2buf(control_write_buf + control_write_len);
 					UEINTX &= ~(1<<RXOUTI);
 
@@ -702,7 +736,7 @@ ISR(USB_COM_vect)
 	/* Other endpoint handling */
 	for (ep=1; ep < NUM_USB_ENDPOINTS; ep++)
 	{
-		if (g_params->epconfigs[ep].enabled) {
+		if (PARAM_BYTE(epconfigs[ep].enabled)) {
 			if (ueint & (1 << ep)) {
 				UENUM = ep;
 				i = UEINTX;
@@ -717,6 +751,7 @@ ISR(USB_COM_vect)
 						// signal "user space" that transmission finished
 						interrupt_data_len[ep] = -1;
 					} else {
+						trace_add(TRACE_EV_USB_TX, (ep << 8) | interrupt_data_len[ep]);
 						UEINTX &= ~(1<<TXINI);
 						buf2EP(ep,
 								interrupt_data[ep],
@@ -732,14 +767,26 @@ ISR(USB_COM_vect)
 				// Interrupt Out and Bulk Out endpoints will get this
 				if (i & (1<<RXOUTI)) {
 					uint8_t count;
-					// First, acknowledge the interrupt
+					uint8_t (*onPacketReceived)(volatile uint8_t *fifo, uint8_t count) = PARAM_PTR(epconfigs[ep].onPacketReceived);
+					void (*onByteReceived)(uint8_t b) = PARAM_PTR(epconfigs[ep].onByteReceived);
+
+					if (onPacketReceived) {
+						if (!onPacketReceived(&UEDATX, UEBCLX)) {
+							// No room. Keep the bank busy so the host gets NAKs,
+							// and mask the interrupt until usb_rxResume().
+							UEIENX &= ~(1<<RXOUTE);
+							continue;
+						}
+					}
+
+					// Acknowledge the interrupt
 					UEINTX &= ~(1<<RXOUTI);
 
-					if (g_params->epconfigs[ep].onByteReceived) {
+					if (onByteReceived) {
 						// get the byte count
 						count = UEBCLX;
 						while (count--) {
-							g_params->epconfigs[ep].onByteReceived(UEDATX);
+							onByteReceived(UEDATX);
 						}
 					}
 
@@ -761,8 +808,13 @@ char usb_interruptReady(int ep)
 void usb_interruptSend(int ep, const void *data, int len)
 {
 	uint8_t sreg = SREG;
+	uint8_t phase;
 
+	stats_count(STATS_CNT_BYTES_TX, len);
+
+	phase = stats_phaseBegin(STATS_PH_USB_TX);
 	while (interrupt_data_len[ep] != -1) { }
+	stats_phaseEnd(phase);
 
 	cli();
 
@@ -791,6 +843,156 @@ void usb_interruptSend(int ep, const void *data, int len)
 	SREG = sreg;
 }
 
+void usb_rxResume(int ep)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	UENUM = ep;
+	// If a packet is still held, RXOUTI is set and the interrupt
+	// fires again as soon as interrupts are enabled.
+	UEIENX |= (1<<RXOUTE);
+	SREG = sreg;
+}
+
+/* State for direct FIFO writes (see usb_fifoBegin) */
+static uint8_t fifo_count;
+static uint8_t fifo_last_full;
+
+// Requires UENUM already set. Interrupts must be disabled.
+static void fifoCommit(void)
+{
+	trace_add(TRACE_EV_USB_TX, (UENUM << 8) | fifo_count);
+	UEINTX &= ~(1<<FIFOCON);
+	fifo_count = 0;
+}
+
+void usb_fifoBegin(int ep)
+{
+	uint8_t phase;
+
+	// Let a transfer started by usb_interruptSend() complete. The ISR then
+	// leaves the endpoint alone (TXINE disabled) until the next call.
+	phase = stats_phaseBegin(STATS_PH_USB_TX);
+	while (interrupt_data_len[ep] != -1) { }
+	stats_phaseEnd(phase);
+
+	fifo_count = 0;
+	fifo_last_full = 0;
+}
+
+void usb_fifoWrite(int ep, const uint8_t *data, uint8_t len)
+{
+	uint8_t sreg = SREG;
+	uint8_t epsize = getEndpointSize(ep);
+	uint8_t phase;
+
+	stats_count(STATS_CNT_BYTES_TX, len);
+
+	phase = stats_phaseBegin(STATS_PH_USB_TX);
+
+	while (len) {
+		// The ISR changes UENUM, so keep interrupts off while
+		// the endpoint is selected.
+		cli();
+		UENUM = ep;
+
+		if (fifo_count == 0) {
+			if (!(UEINTX & (1<<TXINI))) {
+				// Bank still busy. Allow interrupts and retry.
+				SREG = sreg;
+				continue;
+			}
+			UEINTX &= ~(1<<TXINI);
+		}
+
+		while (len && fifo_count < epsize) {
+			UEDATX = *data;
+			data++;
+			fifo_count++;
+			len--;
+		}
+
+		if (fifo_count == epsize) {
+			fifoCommit();
+			fifo_last_full = 1;
+		}
+
+		SREG = sreg;
+	}
+
+	stats_phaseEnd(phase);
+}
+
+void usb_fifoEnd(int ep)
+{
+	uint8_t sreg = SREG;
+	uint8_t phase;
+
+	if (fifo_count == 0 && !fifo_last_full) {
+		return;
+	}
+
+	phase = stats_phaseBegin(STATS_PH_USB_TX);
+
+	while (1) {
+		cli();
+		UENUM = ep;
+
+		if (fifo_count) {
+			// Send the partial packet
+			fifoCommit();
+			break;
+		}
+
+		// The transfer ended on a packet boundary. Send a zero-length
+		// packet so the host does not wait for more data.
+		if (UEINTX & (1<<TXINI)) {
+			UEINTX &= ~(1<<TXINI);
+			fifoCommit();
+			break;
+		}
+
+		SREG = sreg;
+	}
+
+	stats_phaseEnd(phase);
+
+	fifo_last_full = 0;
+	SREG = sreg;
+}
+
+uint8_t usb_fifoTrySend(int ep, const uint8_t *data, uint8_t len)
+{
+	uint8_t sreg = SREG;
+	uint8_t queued = 0;
+
+	if (interrupt_data_len[ep] != -1) {
+		return 0;
+	}
+
+	cli();
+	UENUM = ep;
+
+	// With a dual-bank endpoint, TXINI is set as soon as one of the two
+	// banks is free, so this only fails when both are waiting for the host.
+	if (UEINTX & (1<<TXINI)) {
+		stats_count(STATS_CNT_BYTES_TX, len);
+		trace_add(TRACE_EV_USB_TX, (ep << 8) | len);
+		UEINTX &= ~(1<<TXINI);
+		while (len--) {
+			UEDATX = *data;
+			data++;
+		}
+		UEINTX &= ~(1<<FIFOCON);
+		queued = 1;
+	}
+
+	SREG = sreg;
+
+	return queued;
+}
+
 void usb_shutdown(void)
 {
 	UDCON |= (1<<DETACH);
@@ -13,6 +13,7 @@
 #define INTERFACE_DESCRIPTOR		0x04
 #define ENDPOINT_DESCRIPTOR			0x05
 #define DEVICE_QUALIFIER_DESCRIPTOR	0x06
+#define INTERFACE_ASSOCIATION_DESCRIPTOR	0x0B
 
 // USB HID 1.11 section 7.1.1
 #define HID_DESCRIPTOR				0x21
@@ -52,8 +53,13 @@
 #define USB_DEVICE_CLASS_HID		0x03
 #define USB_DEVICE_CLASS_MASS_STORAGE	0x04
 #define USB_DEVICE_CLASS_HUB		0x05
+#define USB_DEVICE_CLASS_MISC		0xEF
 #define USB_DEVICE_CLASS_VENDOR		0xFF
 
+// For composite devices using interface association descriptors
+#define USB_DEVICE_SUBCLASS_COMMON	0x02
+#define USB_DEVICE_PROTOCOL_IAD		0x01
+
 struct usb_request {
 	uint8_t bmRequestType;
 	uint8_t bRequest;
@@ -105,6 +111,17 @@ struct usb_interface_descriptor {
 	uint8_t iInterface; // String descriptor index
 };
 
+struct usb_interface_association_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType; // INTERFACE_ASSOCIATION_DESCRIPTOR
+	uint8_t bFirstInterface;
+	uint8_t bInterfaceCount;
+	uint8_t bFunctionClass;
+	uint8_t bFunctionSubClass;
+	uint8_t bFunctionProtocol;
+	uint8_t iFunction; // String descriptor index
+};
+
 #define TRANSFER_TYPE_CONTROL		0x0
 #define TRANSFER_TYPE_ISOCHRONOUS	0x1
 #define TRANSFER_TYPE_BULK			0x2
@@ -208,6 +225,8 @@ struct usb_cdc_call_management_functional_descriptor {
 #define USB_PARAM_FLAG_DEVDESC_PROGMEM		1
 #define USB_PARAM_FLAG_CONFDESC_PROGMEM		2
 #define USB_PARAM_FLAG_REPORTDESC_PROGMEM	4
+// The string table and the strings
+#define USB_PARAM_FLAG_STRINGS_PROGMEM		8
 
 #define MAX_HID_INTERFACES	2
 
@@ -233,7 +252,9 @@ struct usb_hid_parameters {
 #define EP_SIZE_32	2
 #define EP_SIZE_64	3
 
-#define NUM_USB_ENDPOINTS 4
+#define EP_FLAG_DUAL_BANK	0x01	// Allocate two banks (ping-pong)
+
+#define NUM_USB_ENDPOINTS 5
 
 struct usb_ep_cfg {
 	uint8_t enabled;
@@ -242,6 +263,15 @@ struct usb_ep_cfg {
 
 	// function pointers for OUT endpoints
 	void (*onByteReceived)(uint8_t b);
+
+	uint8_t flags; // EP_FLAG_*
+
+	// Alternative to onByteReceived: Called from the interrupt handler with
+	// the whole packet waiting in the FIFO. Must read all count bytes from
+	// *fifo and return non-zero, or return 0 (reading nothing) when there is
+	// no room. The packet is then held (the host gets NAKs) and the callback
+	// is retried after usb_rxResume() is called.
+	uint8_t (*onPacketReceived)(volatile uint8_t *fifo, uint8_t count);
 };
 
 struct usb_parameters {
@@ -262,10 +292,12 @@ struct usb_parameters {
 	uint8_t num_strings;
 	const wchar_t *const *strings;
 
-	// Called when an unsupported setup packet arrives. Return non-zero when handled.
+	// Called when an unsupported setup packet arrives. Return non-zero when handled,
+	// or -1 (0xff) to accept a host to device data stage (see handleDataPacket).
 	uint8_t (*setupCb)(const struct usb_request *rq, void (*answerFunc)(const void *src, uint16_t len, uint8_t is_pgmspace));
 
-	// Called when a vendor data packet arrives. Return non-zero when handled.
+	// Called with the data (up to 64 bytes) of a vendor request accepted by setupCb.
+	// The status stage is already done at this point.
 	uint8_t (*handleDataPacket)(const struct usb_request *rq, const uint8_t *dat, uint16_t len);
 
 
@@ -276,6 +308,23 @@ struct usb_parameters {
 char usb_interruptReady(int ep);
 void usb_interruptSend(int ep, const void *data, int len);
 
+/* Direct writes to an IN endpoint FIFO, without an intermediate buffer.
+ * usb_fifoBegin() waits until usb_interruptSend() is done with the
+ * endpoint, usb_fifoWrite() fills and sends packets as they fill up,
+ * and usb_fifoEnd() sends the last partial (or zero-length) packet. */
+void usb_fifoBegin(int ep);
+void usb_fifoWrite(int ep, const uint8_t *data, uint8_t len);
+void usb_fifoEnd(int ep);
+
+/* Copy one packet (up to the endpoint size, 0 for a ZLP) to a free bank of
+ * an IN endpoint without waiting. Returns non-zero if the packet was queued,
+ * 0 if all banks are still waiting to be sent. */
+uint8_t usb_fifoTrySend(int ep, const uint8_t *data, uint8_t len);
+
+/* Retry delivering a packet refused by onPacketReceived */
+void usb_rxResume(int ep);
+
+/* params must be in program memory (PROGMEM) */
 void usb_init(const struct usb_parameters *params);
 void usb_doTasks(void);
 void usb_shutdown(void);
@@ -19,21 +19,36 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include "usbcomm.h"
+#include "stats.h"
+#include "trace.h"
 
 /* When defined, has putchar inject a \r character before
  * every \n character */
 #define PUTCHAR_SENDS_CRLF
 
+// Large enough for a whole XMODEM packet, so the next one can be
+// received while the current one is being programmed.
 #define RXBUF_SIZE	140
 static uint8_t rxbuf[RXBUF_SIZE];
 static volatile uint8_t rxbuf_head = 0;
 static volatile uint8_t rxbuf_tail = 0;
+// Size of a packet refused for lack of room (0 if none)
+static volatile uint8_t rx_waiting;
+// Highest receive buffer level seen since usbcomm_resetHighWater()
+static uint8_t rx_highwater;
 
-#define TXBUF_SIZE	63
+/* Must match the IN endpoint size. Data waiting to be sent is queued
+ * here and in the endpoint banks (two when the endpoint is dual-bank),
+ * so producers only wait when all of them are full. */
+#define TXBUF_SIZE	64
 static uint8_t txbuf[TXBUF_SIZE];
 static uint8_t txbuf_pos = 0;
+// Last packet was full: a zero-length packet must follow when idle
+static uint8_t tx_need_zlp;
 
 static uint16_t (*fn_sendBytes)(const uint8_t *data, uint16_t l) = 0;
+static void (*fn_rxResume)(void) = 0;
+static const struct usbcomm_stream_ops *s_stream_ops;
 static uint8_t s_flags;
 
 void usbcomm_addbyte(uint8_t b)
@@ -46,6 +61,52 @@ void usbcomm_addbyte(uint8_t b)
 	}
 }
 
+static uint8_t rxbufRoom(void)
+{
+	int16_t used = rxbuf_head - rxbuf_tail;
+
+	if (used < 0) {
+		used += RXBUF_SIZE;
+	}
+
+	// One slot stays unused to tell a full buffer from an empty one
+	return RXBUF_SIZE - 1 - used;
+}
+
+uint8_t usbcomm_addpacket(volatile uint8_t *fifo, uint8_t count)
+{
+	uint8_t head;
+
+	if (count > rxbufRoom()) {
+		rx_waiting = count;
+		trace_add(TRACE_EV_RX_FULL, count);
+		return 0;
+	}
+
+	head = rxbuf_head;
+	while (count--) {
+		rxbuf[head] = *fifo;
+		head++;
+		if (head >= RXBUF_SIZE) {
+			head = 0;
+		}
+	}
+	rxbuf_head = head;
+
+	count = RXBUF_SIZE - 1 - rxbufRoom();
+	if (count > rx_highwater) {
+		rx_highwater = count;
+		trace_add(TRACE_EV_RX_HIGHWATER, count);
+	}
+
+	return 1;
+}
+
+void usbcomm_resetHighWater(void)
+{
+	rx_highwater = 0;
+}
+
 static int usbcomm_putchar(char c, FILE *stream)
 {
 #ifdef PUTCHAR_SENDS_CRLF
@@ -65,9 +126,10 @@ static int usbcomm_nullputchar(char c, FILE *stream)
 static FILE mystdout = FDEV_SETUP_STREAM(usbcomm_putchar, NULL, _FDEV_SETUP_WRITE);
 static FILE nullstdout = FDEV_SETUP_STREAM(usbcomm_nullputchar, NULL, _FDEV_SETUP_WRITE);
 
-void usbcomm_init(uint16_t (*ll_tx)(const uint8_t *data, uint16_t len), uint8_t flags)
+void usbcomm_init(uint16_t (*ll_tx)(const uint8_t *data, uint16_t len), void (*ll_rxresume)(void), uint8_t flags)
 {
 	fn_sendBytes = ll_tx;
+	fn_rxResume = ll_rxresume;
 	s_flags = flags;
 
 	if (s_flags & USBCOMM_EN_STDOUT) {
@@ -77,6 +139,40 @@ void usbcomm_init(uint16_t (*ll_tx)(const uint8_t *data, uint16_t len), uint8_t
 	}
 }
 
+void usbcomm_setStreamOps(const struct usbcomm_stream_ops *ops)
+{
+	s_stream_ops = ops;
+}
+
+void usbcomm_streamBegin(void)
+{
+	usbcomm_drain();
+
+	if (s_stream_ops) {
+		// The stream continues the transfer
+		tx_need_zlp = 0;
+		s_stream_ops->begin();
+	}
+}
+
+void usbcomm_streamBytes(const uint8_t *data, uint8_t len)
+{
+	if (s_stream_ops) {
+		s_stream_ops->write(data, len);
+	} else {
+		usbcomm_txbytes((uint8_t*)data, len);
+	}
+}
+
+void usbcomm_streamEnd(void)
+{
+	if (s_stream_ops) {
+		s_stream_ops->end();
+	} else {
+		usbcomm_drain();
+	}
+}
+
 uint8_t usbcomm_hasData(void)
 {
 	uint8_t b, sreg;
@@ -93,25 +189,54 @@ uint8_t usbcomm_rxbyte(void)
 {
 	uint8_t v = rxbuf[rxbuf_tail];
 
+	stats_count(STATS_CNT_BYTES_RX, 1);
+
 	rxbuf_tail++;
 	if (rxbuf_tail >= RXBUF_SIZE) {
 		rxbuf_tail = 0;
 	}
 
+	// Accept the held packet once it fits
+	if (rx_waiting && rxbufRoom() >= rx_waiting) {
+		rx_waiting = 0;
+		if (fn_rxResume) {
+			fn_rxResume();
+		}
+	}
+
 	return v;
 }
 
 void usbcomm_drain()
 {
+	uint8_t phase;
+
+	phase = stats_phaseBegin(STATS_PH_USB_TX);
+
 	do {
 		usbcomm_doTasks();
 	} while (txbuf_pos);
+
+	stats_phaseEnd(phase);
+}
+
+// Send the buffer, waiting only if all endpoint banks are full.
+static void flushFullPacket(void)
+{
+	uint8_t phase;
+
+	phase = stats_phaseBegin(STATS_PH_USB_TX);
+	while (!fn_sendBytes(txbuf, TXBUF_SIZE)) { }
+	stats_phaseEnd(phase);
+
+	txbuf_pos = 0;
+	tx_need_zlp = 1;
 }
 
 void usbcomm_txbyte(uint8_t b)
 {
 	if (txbuf_pos >= TXBUF_SIZE) {
-		usbcomm_drain();
+		flushFullPacket();
 	}
 
 	txbuf[txbuf_pos] = b;
@@ -128,14 +253,18 @@ void usbcomm_txbytes(uint8_t *data, int len)
 
 void usbcomm_doTasks(void)
 {
-	uint16_t sent;
-
 	if (txbuf_pos > 0) {
-		sent = fn_sendBytes(txbuf, txbuf_pos);
-		if (sent) {
-			// everything always gets sent for now.
+		if (fn_sendBytes(txbuf, txbuf_pos)) {
+			// A short packet ends the transfer
+			tx_need_zlp = txbuf_pos == TXBUF_SIZE;
 			txbuf_pos = 0;
 		}
+	} else if (tx_need_zlp) {
+		// Nothing more to send after a full packet. Terminate
+		// the transfer with a zero-length packet.
+		if (fn_sendBytes(txbuf, 0)) {
+			tx_need_zlp = 0;
+		}
 	}
 }
 
@@ -1,18 +1,44 @@
 
 #define USBCOMM_EN_STDOUT	1
 
-void usbcomm_init(uint16_t (*ll_tx)(const uint8_t *data, uint16_t len), uint8_t flags);
+/* Optional low-level functions for zero-copy transmission */
+struct usbcomm_stream_ops {
+	void (*begin)(void);
+	void (*write)(const uint8_t *data, uint8_t len);
+	void (*end)(void);
+};
+
+/* ll_tx must send len bytes (up to 64, possibly 0) as one packet and
+ * return non-zero, or return 0 if it cannot accept a packet yet.
+ * ll_rxresume is called when a packet refused by usbcomm_addpacket()
+ * now fits in the receive buffer. */
+void usbcomm_init(uint16_t (*ll_tx)(const uint8_t *data, uint16_t len), void (*ll_rxresume)(void), uint8_t flags);
+void usbcomm_setStreamOps(const struct usbcomm_stream_ops *ops);
 void usbcomm_doTasks(void);
 
 /* Inject a byte in the receive buffer
  * (data from the host) */
 void usbcomm_addbyte(uint8_t b);
 
+/* Copy a received packet to the receive buffer, reading count bytes from
+ * *fifo. Returns 0 without reading anything when it does not fit. */
+uint8_t usbcomm_addpacket(volatile uint8_t *fifo, uint8_t count);
+
+/* Receive buffer levels above the highest one seen are traced
+ * (TRACE_EV_RX_HIGHWATER). This restarts from zero. */
+void usbcomm_resetHighWater(void);
+
 /* Add a byte to the output buffer */
 void usbcomm_txbyte(uint8_t b);
 void usbcomm_txbytes(uint8_t *data, int len);
 void usbcomm_drain();
 
+/* Send data without going through the output buffer (when stream ops
+ * are available). Anything already buffered is sent first. */
+void usbcomm_streamBegin(void);
+void usbcomm_streamBytes(const uint8_t *data, uint8_t len);
+void usbcomm_streamEnd(void);
+
 /* Check if there is received data pending */
 uint8_t usbcomm_hasData(void);
 
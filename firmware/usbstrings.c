@@ -1,9 +1,14 @@
 #include <stdlib.h> // for wchar_t
+#include <avr/pgmspace.h>
 #include "usbstrings.h"
 
-const wchar_t *g_usb_strings[] = {
-	[0] = L"raphnet.", 	// 1 : Vendor
-	[1] = L"SMSCPROGRv0",	// 2: Product
-	[2] = L"123456",	// 3 : Serial
+static const wchar_t str_vendor[] PROGMEM = L"raphnet.";
+static const wchar_t str_product[] PROGMEM = L"SMSCPROGRv0";
+static const wchar_t str_serial[] PROGMEM = L"123456";
+
+const wchar_t *const g_usb_strings[] PROGMEM = {
+	[0] = str_vendor, 	// 1 : Vendor
+	[1] = str_product,	// 2: Product
+	[2] = str_serial,	// 3 : Serial
 };
 
@@ -3,7 +3,8 @@
 
 #include <stdlib.h> // for wchar_t
 
-extern const wchar_t *g_usb_strings[];
+// In program memory (USB_PARAM_FLAG_STRINGS_PROGMEM)
+extern const wchar_t *const g_usb_strings[];
 
 #define NUM_USB_STRINGS	3
 
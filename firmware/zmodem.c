@@ -0,0 +1,876 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+#include <util/delay.h>
+
+#include "zmodem.h"
+#include "usbcomm.h"
+#include "stats.h"
+
+/* Minimal ZMODEM implementation (one file, CRC-16 only), compatible
+ * with rz/sz from lrzsz. Data is sent as a continuous stream and errors
+ * are reported by offset (ZRPOS), so only what follows a bad subpacket
+ * is sent again. */
+
+#define ZPAD	'*'
+#define ZDLE	0x18
+#define ZBIN	'A'
+#define ZHEX	'B'
+#define ZBIN32	'C'
+
+#define XON		0x11
+#define XOFF	0x13
+#define CAN		0x18
+
+// Frame types
+#define ZRQINIT		0
+#define ZRINIT		1
+#define ZSINIT		2
+#define ZACK		3
+#define ZFILE		4
+#define ZSKIP		5
+#define ZNAK		6
+#define ZABORT		7
+#define ZFIN		8
+#define ZRPOS		9
+#define ZDATA		10
+#define ZEOF		11
+#define ZCHALLENGE	14
+
+// Data subpacket ends
+#define ZCRCE	'h'	// End of frame, header follows
+#define ZCRCG	'i'	// Frame continues nonstop
+#define ZCRCQ	'j'	// Frame continues, ZACK expected
+#define ZCRCW	'k'	// End of frame, ZACK expected
+#define ZRUB0	'l'
+#define ZRUB1	'm'
+
+// ZRINIT flags (ZF0)
+#define CANFDX	0x01
+#define CANOVIO	0x02
+
+// ZFILE conversion option (ZF0)
+#define ZCBIN	1
+
+// Header byte positions
+#define ZF0	3
+#define ZP0	0
+#define ZP1	1
+
+// zm_zdlread() flag for subpacket ends
+#define GOTOR	0x100
+
+#define ZM_ERROR	-1
+#define ZM_TIMEOUT	-2
+#define ZM_CANCEL	-3
+
+#define ZM_CHAR_TIMEOUT_MS	1000
+#define ZM_RETRIES			10
+#define ZM_DUP_WAIT_MS		500
+#define ZM_SUBPACKET_SIZE	1024
+#define ZM_READ_CHUNK		32
+
+/**** Output ****/
+
+static void zm_putHex(uint8_t b)
+{
+	static const char digits[] PROGMEM = "0123456789abcdef";
+
+	usbcomm_txbyte(pgm_read_byte(&digits[b >> 4]));
+	usbcomm_txbyte(pgm_read_byte(&digits[b & 0xf]));
+}
+
+// Bytes which could be mistaken for flow control are escaped
+static uint8_t zm_needsEsc(uint8_t c)
+{
+	switch (c)
+	{
+		case ZDLE:
+		case 0x10: case 0x90:
+		case XON: case XON|0x80:
+		case XOFF: case XOFF|0x80:
+			return 1;
+	}
+	return 0;
+}
+
+static void zm_putEsc(uint8_t c)
+{
+	if (zm_needsEsc(c)) {
+		usbcomm_txbyte(ZDLE);
+		c ^= 0x40;
+	}
+	usbcomm_txbyte(c);
+}
+
+// Like zm_putEsc(), between usbcomm_streamBegin() and usbcomm_streamEnd()
+static void zm_streamEsc(const uint8_t *data, uint8_t len)
+{
+	uint8_t out[16];
+	uint8_t n = 0, c;
+
+	while (len--) {
+		c = *data++;
+		if (zm_needsEsc(c)) {
+			out[n++] = ZDLE;
+			c ^= 0x40;
+		}
+		out[n++] = c;
+
+		if (n >= sizeof(out) - 1) {
+			usbcomm_streamBytes(out, n);
+			n = 0;
+		}
+	}
+
+	if (n) {
+		usbcomm_streamBytes(out, n);
+	}
+}
+
+static void zm_setPos(uint8_t *hdr, uint32_t pos)
+{
+	hdr[ZP0] = pos;
+	hdr[ZP0+1] = pos >> 8;
+	hdr[ZP0+2] = pos >> 16;
+	hdr[ZP0+3] = pos >> 24;
+}
+
+static uint32_t zm_getPos(const uint8_t *hdr)
+{
+	return hdr[ZP0] | ((uint32_t)hdr[ZP0+1] << 8) |
+			((uint32_t)hdr[ZP0+2] << 16) | ((uint32_t)hdr[ZP0+3] << 24);
+}
+
+static void zm_sendHexHeader(uint8_t type, const uint8_t *hdr)
+{
+	uint16_t crc;
+	uint8_t i;
+
+	usbcomm_txbyte(ZPAD);
+	usbcomm_txbyte(ZPAD);
+	usbcomm_txbyte(ZDLE);
+	usbcomm_txbyte(ZHEX);
+
+	zm_putHex(type);
+	crc = _crc_xmodem_update(0, type);
+	for (i=0; i<4; i++) {
+		zm_putHex(hdr[i]);
+		crc = _crc_xmodem_update(crc, hdr[i]);
+	}
+	zm_putHex(crc >> 8);
+	zm_putHex(crc);
+
+	usbcomm_txbyte('\r');
+	usbcomm_txbyte('\n' | 0x80);
+	if (type != ZFIN && type != ZACK) {
+		usbcomm_txbyte(XON);
+	}
+
+	usbcomm_drain();
+}
+
+static void zm_sendBinHeader(uint8_t type, const uint8_t *hdr)
+{
+	uint16_t crc;
+	uint8_t i;
+
+	usbcomm_txbyte(ZPAD);
+	usbcomm_txbyte(ZDLE);
+	usbcomm_txbyte(ZBIN);
+
+	zm_putEsc(type);
+	crc = _crc_xmodem_update(0, type);
+	for (i=0; i<4; i++) {
+		zm_putEsc(hdr[i]);
+		crc = _crc_xmodem_update(crc, hdr[i]);
+	}
+	zm_putEsc(crc >> 8);
+	zm_putEsc(crc);
+}
+
+static void zm_sendPosHeader(uint8_t type, uint32_t pos)
+{
+	uint8_t hdr[4];
+
+	zm_setPos(hdr, pos);
+	zm_sendHexHeader(type, hdr);
+}
+
+static void zm_sendRinit(void)
+{
+	uint8_t hdr[4] = { };
+
+	// Subpackets must fit in the stage buffer: Data is only written
+	// once its CRC is checked, flash cannot be written twice. The ZACK
+	// is sent before programming, so the sender does not wait for it.
+	hdr[ZP0] = ZMODEM_STAGE_SIZE & 0xff;
+	hdr[ZP1] = ZMODEM_STAGE_SIZE >> 8;
+	hdr[ZF0] = CANFDX | CANOVIO;
+	zm_sendHexHeader(ZRINIT, hdr);
+}
+
+// Terminate a data subpacket whose data CRC is crc
+static void zm_endData(uint16_t crc, uint8_t frameend)
+{
+	crc = _crc_xmodem_update(crc, frameend);
+
+	usbcomm_txbyte(ZDLE);
+	usbcomm_txbyte(frameend);
+	zm_putEsc(crc >> 8);
+	zm_putEsc(crc);
+
+	if (frameend == ZCRCW) {
+		usbcomm_txbyte(XON);
+		usbcomm_drain();
+	}
+}
+
+/**** Input ****/
+
+static int zm_getc(void)
+{
+	uint16_t i;
+	uint8_t j, phase;
+	int c = ZM_TIMEOUT;
+
+	usbcomm_doTasks();
+
+	phase = stats_phaseBegin(STATS_PH_HOST_WAIT);
+
+	for (i=0; i<ZM_CHAR_TIMEOUT_MS; i++) {
+		for (j=0; j<100; j++) {
+			if (usbcomm_hasData()) {
+				c = usbcomm_rxbyte();
+				goto done;
+			}
+			_delay_us(10);
+		}
+	}
+
+	stats_count(STATS_CNT_TIMEOUTS, 1);
+
+done:
+	stats_phaseEnd(phase);
+
+	return c;
+}
+
+static uint8_t zm_dataWithin(uint16_t timeout_ms)
+{
+	uint16_t i;
+	uint8_t j, phase, res = 0;
+
+	phase = stats_phaseBegin(STATS_PH_HOST_WAIT);
+
+	for (i=0; i<timeout_ms; i++) {
+		for (j=0; j<100; j++) {
+			if (usbcomm_hasData()) {
+				res = 1;
+				goto done;
+			}
+			_delay_us(10);
+		}
+	}
+
+done:
+	stats_phaseEnd(phase);
+
+	return res;
+}
+
+// Read a byte, undoing ZDLE escaping. Subpacket ends are
+// returned with the GOTOR bit set.
+static int zm_zdlread(void)
+{
+	int c;
+	uint8_t cancount;
+
+	while (1) {
+		c = zm_getc();
+		if (c < 0)
+			return c;
+
+		switch (c)
+		{
+			case XON: case XON|0x80:
+			case XOFF: case XOFF|0x80:
+				continue;
+		}
+
+		if (c != ZDLE)
+			return c;
+
+		cancount = 1;
+		while (1) {
+			c = zm_getc();
+			if (c < 0)
+				return c;
+
+			switch (c)
+			{
+				case CAN:
+					if (++cancount >= 5)
+						return ZM_CANCEL;
+					continue;
+				case XON: case XON|0x80:
+				case XOFF: case XOFF|0x80:
+					continue;
+				case ZCRCE: case ZCRCG: case ZCRCQ: case ZCRCW:
+					return c | GOTOR;
+				case ZRUB0:
+					return 0x7f;
+				case ZRUB1:
+					return 0xff;
+			}
+
+			if ((c & 0x60) == 0x40)
+				return c ^ 0x40;
+
+			return ZM_ERROR;
+		}
+	}
+}
+
+static int zm_gethex(void)
+{
+	int c;
+	uint8_t i, v = 0;
+
+	for (i=0; i<2; i++) {
+		c = zm_getc();
+		if (c < 0)
+			return c;
+		c &= 0x7f;
+
+		v <<= 4;
+		if (c >= '0' && c <= '9') {
+			v |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			v |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			v |= c - 'A' + 10;
+		} else {
+			return ZM_ERROR;
+		}
+	}
+
+	return v;
+}
+
+// Receive the type and 4 header bytes, then the CRC. Returns the
+// frame type or an error.
+static int zm_recvHeaderBody(uint8_t *hdr, uint8_t hex)
+{
+	uint8_t buf[7];
+	uint16_t crc = 0;
+	uint8_t i;
+	int c;
+
+	for (i=0; i<sizeof(buf); i++) {
+		c = hex ? zm_gethex() : zm_zdlread();
+		if (c < 0)
+			return c;
+		if (c & GOTOR)
+			return ZM_ERROR;
+
+		buf[i] = c;
+		crc = _crc_xmodem_update(crc, c);
+	}
+
+	if (crc) {
+		return ZM_ERROR;
+	}
+
+	for (i=0; i<4; i++) {
+		hdr[i] = buf[1+i];
+	}
+
+	return buf[0];
+}
+
+// Receive the rest of a header once a ZPAD was seen
+static int zm_recvHeaderPad(uint8_t *hdr)
+{
+	int c;
+
+	do {
+		c = zm_getc();
+	} while (c == ZPAD);
+
+	if (c < 0)
+		return c;
+	if (c != ZDLE)
+		return ZM_ERROR;
+
+	c = zm_getc();
+	if (c < 0)
+		return c;
+	if (c == ZHEX)
+		return zm_recvHeaderBody(hdr, 1);
+	if (c == ZBIN)
+		return zm_recvHeaderBody(hdr, 0);
+
+	// ZBIN32 is not expected since CANFC32 is never advertised
+	return ZM_ERROR;
+}
+
+// Wait for a header, skipping anything else. Returns the frame type or
+// an error (timeout, cancellation, bad CRC...)
+static int zm_recvHeader(uint8_t *hdr)
+{
+	uint8_t cancount = 0;
+	int c;
+
+	while (1) {
+		c = zm_getc();
+		if (c < 0)
+			return c;
+
+		if (c == CAN) {
+			if (++cancount >= 5)
+				return ZM_CANCEL;
+			continue;
+		}
+		cancount = 0;
+
+		if (c == ZPAD) {
+			c = zm_recvHeaderPad(hdr);
+			if (c != ZM_ERROR)
+				return c;
+		}
+	}
+}
+
+/**** Sender ****/
+
+static int zm_waitHeader(uint8_t *hdr)
+{
+	int type;
+
+	type = zm_recvHeader(hdr);
+	if (type == ZCHALLENGE) {
+		// Echo the challenge value
+		zm_sendHexHeader(ZACK, hdr);
+	}
+
+	return type;
+}
+
+static void zm_sendFileInfo(const char *name, uint32_t size)
+{
+	uint8_t hdr[4] = { };
+	char sizestr[11];
+	uint16_t crc = 0;
+	char c;
+	uint8_t i;
+
+	hdr[ZF0] = ZCBIN;
+	zm_sendBinHeader(ZFILE, hdr);
+
+	// filename NUL size NUL
+	do {
+		c = pgm_read_byte(name++);
+		zm_putEsc(c);
+		crc = _crc_xmodem_update(crc, c);
+	} while (c);
+
+	ultoa(size, sizestr, 10);
+	for (i=0; ; i++) {
+		zm_putEsc(sizestr[i]);
+		crc = _crc_xmodem_update(crc, sizestr[i]);
+		if (!sizestr[i])
+			break;
+	}
+
+	zm_endData(crc, ZCRCW);
+}
+
+// Stream the file from pos. Returns when the end is reached (0), the
+// receiver asked for another position (*pos updated, 1) or on error (-1).
+static int8_t zm_sendData(uint32_t *pos, uint32_t size, zmodem_read_fn read)
+{
+	uint8_t chunk[ZM_READ_CHUNK];
+	uint8_t hdr[4];
+	uint8_t cancount = 0;
+	uint16_t crc, n, i, j, l;
+	uint8_t end;
+	int type;
+
+	if (*pos < size) {
+		zm_setPos(hdr, *pos);
+		zm_sendBinHeader(ZDATA, hdr);
+	}
+
+	while (*pos < size) {
+		n = ZM_SUBPACKET_SIZE;
+		if (size - *pos < n) {
+			n = size - *pos;
+		}
+
+		// Subpackets go straight to the endpoint in full packets
+		usbcomm_streamBegin();
+
+		crc = 0;
+		for (i=0; i<n; i+=l) {
+			l = n - i;
+			if (l > sizeof(chunk)) {
+				l = sizeof(chunk);
+			}
+			// Reads must not cross a 16K bank
+			if (l > 0x4000 - ((*pos + i) & 0x3FFF)) {
+				l = 0x4000 - ((*pos + i) & 0x3FFF);
+			}
+			read(*pos + i, l, chunk);
+			zm_streamEsc(chunk, l);
+			for (j=0; j<l; j++) {
+				crc = _crc_xmodem_update(crc, chunk[j]);
+			}
+		}
+
+		*pos += n;
+		end = *pos < size ? ZCRCG : ZCRCE;
+		crc = _crc_xmodem_update(crc, end);
+
+		chunk[0] = ZDLE;
+		chunk[1] = end;
+		usbcomm_streamBytes(chunk, 2);
+		chunk[0] = crc >> 8;
+		chunk[1] = crc;
+		zm_streamEsc(chunk, 2);
+
+		usbcomm_streamEnd();
+
+		// The receiver only talks when something went wrong. Skip
+		// anything but headers (e.g. what follows a ZRINIT sent twice).
+		while (usbcomm_hasData()) {
+			type = usbcomm_rxbyte();
+			if (type == CAN) {
+				if (++cancount >= 5)
+					return -1;
+				continue;
+			}
+			cancount = 0;
+
+			if (type != ZPAD)
+				continue;
+
+			type = zm_recvHeaderPad(hdr);
+			if (type == ZM_CANCEL || type == ZABORT) {
+				return -1;
+			}
+			if (type == ZRPOS) {
+				// The receiver now ignores data until the next header
+				stats_count(STATS_CNT_NAKS, 1);
+				*pos = zm_getPos(hdr);
+				return 1;
+			}
+		}
+	}
+
+	usbcomm_drain();
+
+	return 0;
+}
+
+int8_t zmodem_send(const char *name, uint32_t size, zmodem_read_fn read)
+{
+	uint8_t hdr[4] = { };
+	uint32_t pos = 0;
+	uint8_t tries;
+	int type;
+	int8_t res;
+
+	// Start the receiver (if a shell is listening) and look for it
+	usbcomm_txbyte('r');
+	usbcomm_txbyte('z');
+	usbcomm_txbyte('\r');
+	for (tries=0; ; tries++) {
+		if (tries >= ZM_RETRIES)
+			return -1;
+
+		zm_sendHexHeader(ZRQINIT, hdr);
+		type = zm_waitHeader(hdr);
+		if (type == ZM_CANCEL)
+			return -1;
+		if (type == ZRINIT)
+			break;
+	}
+
+	for (tries=0; ; tries++) {
+		if (tries >= ZM_RETRIES)
+			return -1;
+		if (tries) {
+			stats_count(STATS_CNT_RETRANSMITS, 1);
+		}
+
+		zm_sendFileInfo(name, size);
+wait_rpos:
+		type = zm_waitHeader(hdr);
+		if (type == ZM_CANCEL)
+			return -1;
+		if (type == ZSKIP)
+			goto finish;
+		if (type == ZRPOS) {
+			pos = zm_getPos(hdr);
+			break;
+		}
+		// The receiver may send ZRINIT more than once (at startup and
+		// in reply to ZRQINIT). Only resend if nothing else follows.
+		if (type == ZRINIT && zm_dataWithin(ZM_DUP_WAIT_MS))
+			goto wait_rpos;
+	}
+
+	tries = 0;
+	while (1) {
+		res = zm_sendData(&pos, size, read);
+		if (res < 0)
+			return -1;
+		if (res > 0) {
+			// Resend from the requested position
+			stats_count(STATS_CNT_RETRANSMITS, 1);
+			continue;
+		}
+
+		for (; ; tries++) {
+			if (tries >= ZM_RETRIES)
+				return -1;
+
+			zm_setPos(hdr, size);
+			zm_sendBinHeader(ZEOF, hdr);
+			type = zm_waitHeader(hdr);
+			if (type == ZM_CANCEL)
+				return -1;
+			if (type == ZRINIT)
+				goto finish;
+			if (type == ZRPOS) {
+				stats_count(STATS_CNT_NAKS, 1);
+				stats_count(STATS_CNT_RETRANSMITS, 1);
+				pos = zm_getPos(hdr);
+				break;
+			}
+		}
+	}
+
+finish:
+	for (tries=0; tries < ZM_RETRIES; tries++) {
+		zm_setPos(hdr, 0);
+		zm_sendHexHeader(ZFIN, hdr);
+		type = zm_waitHeader(hdr);
+		if (type == ZFIN || type == ZM_CANCEL)
+			break;
+	}
+
+	// Over and out
+	usbcomm_txbyte('O');
+	usbcomm_txbyte('O');
+	usbcomm_drain();
+
+	return 0;
+}
+
+/**** Receiver ****/
+
+struct zm_rx {
+	uint8_t *buf;
+	zmodem_write_fn write;
+	uint32_t pos;		// Offset following the last good subpacket
+	uint8_t count;		// Bytes of the last good subpacket in buf
+};
+
+// Write the last good subpacket, without crossing ZMODEM_STAGE_SIZE
+// boundaries, and advance rx->pos
+static void zm_store(struct zm_rx *rx)
+{
+	uint8_t i, n, count = rx->count;
+
+	for (i=0; i<count; i+=n) {
+		n = ZMODEM_STAGE_SIZE - (rx->pos % ZMODEM_STAGE_SIZE);
+		if (n > count - i) {
+			n = count - i;
+		}
+		rx->write(rx->pos, rx->buf + i, n);
+		rx->pos += n;
+	}
+}
+
+// Receive a data subpacket. When store is set, the data is held in
+// rx->buf and rx->count is set if the CRC is good (see zm_store()). A
+// subpacket larger than the buffer is an error. Returns the subpacket
+// end (ZCRCx) or an error.
+static int zm_recvData(struct zm_rx *rx, uint8_t store)
+{
+	uint16_t crc = 0;
+	uint16_t count = 0;
+	uint8_t i;
+	int c, end;
+
+	rx->count = 0;
+
+	while (1) {
+		c = zm_zdlread();
+		if (c < 0)
+			return c;
+
+		crc = _crc_xmodem_update(crc, c);
+
+		if (c & GOTOR)
+			break;
+
+		if (!store)
+			continue;
+
+		// Keep reading to the end of an oversized subpacket
+		if (count < ZMODEM_STAGE_SIZE) {
+			rx->buf[count] = c;
+		}
+		count++;
+	}
+
+	end = c & 0xff;
+
+	for (i=0; i<2; i++) {
+		c = zm_zdlread();
+		if (c < 0)
+			return c;
+		crc = _crc_xmodem_update(crc, c);
+	}
+
+	if (crc || (c & GOTOR) || count > ZMODEM_STAGE_SIZE) {
+		return ZM_ERROR;
+	}
+
+	if (store) {
+		rx->count = count;
+	}
+
+	return end;
+}
+
+int8_t zmodem_receive(uint8_t *buf, zmodem_write_fn write, uint32_t *received)
+{
+	struct zm_rx rx = { .buf = buf, .write = write };
+	uint8_t hdr[4];
+	uint8_t tries = 0;
+	uint8_t got_file = 0;
+	int8_t res = -1;
+	int type;
+
+	zm_sendRinit();
+
+	while (tries < ZM_RETRIES) {
+		type = zm_recvHeader(hdr);
+
+		switch (type)
+		{
+			case ZM_CANCEL:
+				goto done;
+
+			case ZM_TIMEOUT:
+			case ZM_ERROR:
+				tries++;
+				if (got_file) {
+					stats_count(STATS_CNT_NAKS, 1);
+					zm_sendPosHeader(ZRPOS, rx.pos);
+				} else {
+					zm_sendRinit();
+				}
+				break;
+
+			case ZRQINIT:
+				zm_sendRinit();
+				break;
+
+			case ZSINIT:
+				// Nothing of use (attention string)
+				if (zm_recvData(&rx, 0) >= 0) {
+					zm_sendPosHeader(ZACK, 1);
+				}
+				break;
+
+			case ZFILE:
+				if (zm_recvData(&rx, 0) < 0) {
+					zm_sendRinit();
+					break;
+				}
+				if (got_file && rx.pos) {
+					// Only one file per transfer
+					zm_sendPosHeader(ZSKIP, 0);
+					break;
+				}
+				got_file = 1;
+				tries = 0;
+				zm_sendPosHeader(ZRPOS, rx.pos);
+				break;
+
+			case ZDATA:
+				if (!got_file)
+					break;
+				if (zm_getPos(hdr) != rx.pos) {
+					// Data following a ZRPOS that was not seen yet
+					zm_sendPosHeader(ZRPOS, rx.pos);
+					break;
+				}
+
+				while (1) {
+					type = zm_recvData(&rx, 1);
+					if (type == ZM_CANCEL)
+						goto done;
+					if (type < 0) {
+						tries++;
+						stats_count(STATS_CNT_NAKS, 1);
+						zm_sendPosHeader(ZRPOS, rx.pos);
+						break;
+					}
+
+					tries = 0;
+					// Acknowledge before programming (like XModem
+					// uploads), so the next subpacket arrives meanwhile
+					if (type == ZCRCQ || type == ZCRCW) {
+						zm_sendPosHeader(ZACK, rx.pos + rx.count);
+					}
+					zm_store(&rx);
+					if (type == ZCRCE || type == ZCRCW) {
+						break;
+					}
+				}
+				break;
+
+			case ZEOF:
+				if (!got_file || zm_getPos(hdr) != rx.pos)
+					break;
+				zm_sendRinit();
+				break;
+
+			case ZFIN:
+				zm_sendPosHeader(ZFIN, 0);
+				// Wait for "OO"
+				zm_getc();
+				zm_getc();
+				res = got_file ? 0 : -1;
+				goto done;
+		}
+	}
+
+done:
+	*received = rx.pos;
+
+	return res;
+}
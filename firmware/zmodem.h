@@ -0,0 +1,23 @@
+#ifndef _zmodem_h__
+#define _zmodem_h__
+
+#include <stdint.h>
+
+/* Read len bytes of the file at offset */
+typedef void (*zmodem_read_fn)(uint32_t offset, uint16_t len, uint8_t *dst);
+
+/* Store len bytes at offset. Calls never cross a 128 byte boundary. */
+typedef void (*zmodem_write_fn)(uint32_t offset, const uint8_t *data, uint8_t len);
+
+/* Send a file (the receiver is started with "rz"). name is in program
+ * memory. Returns 0 on success, -1 on error or cancellation. */
+int8_t zmodem_send(const char *name, uint32_t size, zmodem_read_fn read);
+
+/* Receive a file. buf (ZMODEM_STAGE_SIZE bytes) holds each data subpacket
+ * until its CRC is checked, the sender is told to use subpackets of at most
+ * this size. The number of bytes received is stored in *received.
+ * Returns 0 on success, -1 on error or cancellation. */
+#define ZMODEM_STAGE_SIZE	128
+int8_t zmodem_receive(uint8_t *buf, zmodem_write_fn write, uint32_t *received);
+
+#endif // _zmodem_h__
@@ -0,0 +1,109 @@
+#ifndef _smscprogr_programmer_h__
+#define _smscprogr_programmer_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace smscprogr {
+
+// Must match firmware/rpc.h
+enum {
+	RPC_OP_PING = 0x00,
+	RPC_OP_COMMAND = 0x01,
+	RPC_OP_INFO = 0x02,
+	RPC_OP_READ = 0x03,
+	RPC_OP_PROGRAM = 0x04,
+	RPC_OP_ERASE_SECTOR = 0x05,
+	RPC_OP_PROGRAM_BEGIN = 0x06,
+};
+
+enum {
+	RPC_STATUS_OK = 0x00,
+	RPC_STATUS_MORE = 0x01,
+	RPC_STATUS_ERR_CRC = 0x80,
+	RPC_STATUS_ERR_OP = 0x81,
+	RPC_STATUS_ERR_ARGS = 0x82,
+	RPC_STATUS_ERR_REFUSED = 0x83,
+};
+
+constexpr size_t RPC_MAX_DATA = 64;
+
+class Error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+struct Info {
+	uint32_t rom_size;
+	uint32_t flash_size;	// 0 if not a flash cartridge
+	uint8_t mapper_type;
+};
+
+class SerialPort;
+
+/* Talks to the programmer with binary command frames. Requests are
+ * submitted without waiting (up to 256 in flight), replies are matched
+ * by request ID as they arrive. */
+class Programmer {
+public:
+	// Receives the data of each reply to a request, as it arrives
+	using DataHandler = std::function<void(const uint8_t *data, size_t len)>;
+	// Bytes done out of total
+	using Progress = std::function<void(uint64_t done, uint64_t total)>;
+
+	explicit Programmer(const std::string &device);
+	~Programmer();
+
+	/* Queue a request, returns its ID */
+	uint8_t submit(uint8_t op, const std::vector<uint8_t> &payload, DataHandler on_data = nullptr);
+	/* Wait for the last reply to a request, returns its status. Throws
+	 * Error on timeout. */
+	uint8_t wait(uint8_t id);
+	/* Do pending I/O for up to timeout_ms. Returns false on timeout. */
+	bool poll(int timeout_ms);
+	size_t inFlight() const { return m_pending.size(); }
+
+	/* Requests kept in flight by dump() and program() */
+	void setWindow(size_t window) { m_window = window ? window : 1; }
+	/* Time to wait for a reply (ms) */
+	void setTimeout(int timeout_ms) { m_timeout = timeout_ms; }
+
+	// Blocking helpers. They throw Error if the programmer reports an error.
+	void ping(uint8_t *protocol_version, uint16_t *firmware_version);
+	std::string command(const std::string &line);
+	Info info();
+	void eraseSector(uint32_t rom_addr);
+	/* Read size bytes from rom_addr, written to fd as they arrive */
+	void dump(int fd, uint32_t rom_addr, uint32_t size, Progress progress = nullptr);
+	/* Program from address 0. Blocks of 0xFF are left out. Sectors past
+	 * len are not erased. */
+	void program(const uint8_t *data, size_t len, Progress progress = nullptr);
+
+private:
+	struct Pending {
+		DataHandler on_data;
+		bool done = false;
+		uint8_t status = 0;
+	};
+
+	void call(uint8_t op, const std::vector<uint8_t> &payload, DataHandler on_data = nullptr);
+	void receive(const uint8_t *data, size_t len);
+	void handleReply(const std::vector<uint8_t> &frame);
+
+	std::unique_ptr<SerialPort> m_port;
+	std::map<uint8_t, Pending> m_pending;
+	std::vector<uint8_t> m_rx;
+	uint8_t m_next_id = 0;
+	size_t m_window = 8;
+	int m_timeout = 10000;
+};
+
+} // namespace smscprogr
+
+#endif // _smscprogr_programmer_h__
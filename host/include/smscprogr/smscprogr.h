@@ -0,0 +1,49 @@
+#ifndef _smscprogr_h__
+#define _smscprogr_h__
+
+/* C interface to the host library, for bindings (see client/smsphost.py).
+ * Functions returning int return 0 (or a length) on success and -1 on
+ * error, with the message available from smsp_last_error(). */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct smsp_handle smsp_handle;
+
+/* Bytes done out of total */
+typedef void (*smsp_progress_cb)(uint64_t done, uint64_t total, void *user);
+
+struct smsp_info {
+	uint32_t rom_size;
+	uint32_t flash_size;	// 0 if not a flash cartridge
+	uint8_t mapper_type;
+};
+
+/* Returns NULL on error (see smsp_last_error(NULL)) */
+smsp_handle *smsp_open(const char *device);
+void smsp_close(smsp_handle *h);
+/* Message for the last error. h may be NULL after smsp_open() failed. */
+const char *smsp_last_error(smsp_handle *h);
+
+/* Requests kept in flight by smsp_dump_fd() and smsp_program() */
+void smsp_set_window(smsp_handle *h, unsigned int window);
+
+/* Run a text command. Its output is stored in out (NUL terminated,
+ * truncated if needed). Returns the output length. */
+int smsp_command(smsp_handle *h, const char *line, char *out, size_t out_size);
+int smsp_get_info(smsp_handle *h, struct smsp_info *info);
+int smsp_erase_sector(smsp_handle *h, uint32_t rom_addr);
+/* Read size bytes from rom_addr, written to fd as they arrive */
+int smsp_dump_fd(smsp_handle *h, int fd, uint32_t rom_addr, uint32_t size, smsp_progress_cb cb, void *user);
+/* Program from address 0. Blocks of 0xFF are left out. */
+int smsp_program(smsp_handle *h, const uint8_t *data, size_t len, smsp_progress_cb cb, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _smscprogr_h__
@@ -0,0 +1,118 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cstring>
+
+#include "smscprogr/smscprogr.h"
+#include "smscprogr/programmer.h"
+
+using smscprogr::Programmer;
+
+struct smsp_handle {
+	Programmer *prog;
+	std::string error;
+};
+
+// For smsp_open() failures
+static std::string s_open_error;
+
+/* Run fn, storing the message of an exception in the handle */
+template <typename Fn> static int guard(smsp_handle *h, Fn fn)
+{
+	try {
+		fn();
+		return 0;
+	} catch (const std::exception &e) {
+		h->error = e.what();
+		return -1;
+	}
+}
+
+static Programmer::Progress progressFn(smsp_progress_cb cb, void *user)
+{
+	if (!cb)
+		return nullptr;
+
+	return [cb, user](uint64_t done, uint64_t total) { cb(done, total, user); };
+}
+
+smsp_handle *smsp_open(const char *device)
+{
+	try {
+		return new smsp_handle{ new Programmer(device), "" };
+	} catch (const std::exception &e) {
+		s_open_error = e.what();
+		return NULL;
+	}
+}
+
+void smsp_close(smsp_handle *h)
+{
+	if (h) {
+		delete h->prog;
+		delete h;
+	}
+}
+
+const char *smsp_last_error(smsp_handle *h)
+{
+	return h ? h->error.c_str() : s_open_error.c_str();
+}
+
+void smsp_set_window(smsp_handle *h, unsigned int window)
+{
+	h->prog->setWindow(window);
+}
+
+int smsp_command(smsp_handle *h, const char *line, char *out, size_t out_size)
+{
+	std::string output;
+
+	if (guard(h, [&] { output = h->prog->command(line); }))
+		return -1;
+
+	if (out_size) {
+		output.resize(std::min(output.size(), out_size - 1));
+		memcpy(out, output.c_str(), output.size() + 1);
+	}
+
+	return output.size();
+}
+
+int smsp_get_info(smsp_handle *h, struct smsp_info *info)
+{
+	return guard(h, [&] {
+		smscprogr::Info i = h->prog->info();
+		info->rom_size = i.rom_size;
+		info->flash_size = i.flash_size;
+		info->mapper_type = i.mapper_type;
+	});
+}
+
+int smsp_erase_sector(smsp_handle *h, uint32_t rom_addr)
+{
+	return guard(h, [&] { h->prog->eraseSector(rom_addr); });
+}
+
+int smsp_dump_fd(smsp_handle *h, int fd, uint32_t rom_addr, uint32_t size, smsp_progress_cb cb, void *user)
+{
+	return guard(h, [&] { h->prog->dump(fd, rom_addr, size, progressFn(cb, user)); });
+}
+
+int smsp_program(smsp_handle *h, const uint8_t *data, size_t len, smsp_progress_cb cb, void *user)
+{
+	return guard(h, [&] { h->prog->program(data, len, progressFn(cb, user)); });
+}
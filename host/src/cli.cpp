@@ -0,0 +1,156 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+#include "smscprogr/programmer.h"
+
+using namespace smscprogr;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d device] [-w window] command [args]\n", name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Commands:\n");
+	fprintf(stderr, "  cmd \"text\"         Run a text command (e.g. init) and print its output\n");
+	fprintf(stderr, "  info               Show the ROM and flash size (after init)\n");
+	fprintf(stderr, "  dump file [size]   Dump the ROM (default: size from init), - for stdout\n");
+	fprintf(stderr, "  program file       Program a flash cartridge\n");
+	fprintf(stderr, "  erase address      Erase the flash sector holding address\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Default device: /dev/ttyACM0\n");
+}
+
+static void printProgress(uint64_t done, uint64_t total)
+{
+	static uint64_t last;
+
+	// Every 1%
+	if (done != total && done > last && done - last < total / 100)
+		return;
+	last = done == total ? 0 : done;
+
+	fprintf(stderr, "\r%llu / %llu bytes", (unsigned long long)done, (unsigned long long)total);
+	if (done == total) {
+		fprintf(stderr, "\n");
+	}
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int dump(Programmer &prog, const char *path, uint32_t size)
+{
+	auto start = std::chrono::steady_clock::now();
+	int fd;
+
+	if (!size) {
+		size = prog.info().rom_size;
+	}
+
+	fd = strcmp(path, "-") ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	prog.dump(fd, 0, size, printProgress);
+	if (fd != STDOUT_FILENO) {
+		close(fd);
+	}
+
+	fprintf(stderr, "%u bytes received in %.2f seconds\n", size, secondsSince(start));
+	return 0;
+}
+
+static int program(Programmer &prog, const char *path)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::ifstream file(path, std::ios::binary);
+	std::vector<uint8_t> data;
+
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	prog.program(data.data(), data.size(), printProgress);
+
+	fprintf(stderr, "%zu bytes programmed in %.2f seconds\n", data.size(), secondsSince(start));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "/dev/ttyACM0";
+	const char *cmd;
+	int opt, window = 0;
+
+	while ((opt = getopt(argc, argv, "d:w:h")) != -1) {
+		switch (opt)
+		{
+			case 'd': device = optarg; break;
+			case 'w': window = atoi(optarg); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	cmd = argv[optind];
+
+	try {
+		Programmer prog(device);
+		if (window > 0) {
+			prog.setWindow(window);
+		}
+
+		if (!strcmp(cmd, "cmd") && optind + 1 < argc) {
+			fputs(prog.command(argv[optind + 1]).c_str(), stdout);
+		} else if (!strcmp(cmd, "info")) {
+			Info info = prog.info();
+			printf("ROM size: %u\n", info.rom_size);
+			printf("Flash size: %u\n", info.flash_size);
+			printf("Mapper type: %u\n", info.mapper_type);
+		} else if (!strcmp(cmd, "dump") && optind + 1 < argc) {
+			return dump(prog, argv[optind + 1], optind + 2 < argc ? strtoul(argv[optind + 2], NULL, 0) : 0);
+		} else if (!strcmp(cmd, "program") && optind + 1 < argc) {
+			return program(prog, argv[optind + 1]);
+		} else if (!strcmp(cmd, "erase") && optind + 1 < argc) {
+			prog.eraseSector(strtoul(argv[optind + 1], NULL, 0));
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	} catch (const Error &e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
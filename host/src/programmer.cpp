@@ -0,0 +1,379 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <poll.h>
+#include <unistd.h>
+
+#include "smscprogr/programmer.h"
+#include "serialport.h"
+
+namespace smscprogr {
+
+// Must match firmware/rpc.h
+#define RPC_SYNC			0xA5
+#define RPC_REPLY_SYNC		0xA6
+// Sync, opcode, request ID, status, length
+#define REPLY_HEADER_SIZE	5
+
+// Bytes per READ request when dumping
+#define DUMP_CHUNK	4096
+
+/* CRC-16 (XMODEM), as _crc_xmodem_update() in the firmware */
+static uint16_t crc16Update(uint16_t crc, const uint8_t *data, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= (uint16_t)*data++ << 8;
+		for (i=0; i<8; i++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+static void put32(std::vector<uint8_t> &v, uint32_t value)
+{
+	for (int i=0; i<4; i++) {
+		v.push_back(value >> (i * 8));
+	}
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char *statusString(uint8_t status)
+{
+	switch (status)
+	{
+		case RPC_STATUS_ERR_CRC: return "bad CRC";
+		case RPC_STATUS_ERR_OP: return "unknown opcode";
+		case RPC_STATUS_ERR_ARGS: return "bad arguments";
+		case RPC_STATUS_ERR_REFUSED: return "command not allowed in a frame";
+	}
+	return "unknown error";
+}
+
+static void writeAll(int fd, const uint8_t *data, size_t len)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			throw Error(std::string("write: ") + strerror(errno));
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+Programmer::Programmer(const std::string &device) : m_port(new SerialPort(device))
+{
+	// End any partially typed text command, so frames start a line
+	const uint8_t cr = '\r';
+	m_port->queue(&cr, 1);
+}
+
+Programmer::~Programmer()
+{
+}
+
+uint8_t Programmer::submit(uint8_t op, const std::vector<uint8_t> &payload, DataHandler on_data)
+{
+	std::vector<uint8_t> frame;
+	uint16_t crc;
+	uint8_t id;
+
+	if (payload.size() > 4 + RPC_MAX_DATA) {
+		throw Error("Request payload too large");
+	}
+	if (m_pending.size() >= 256) {
+		throw Error("Too many requests in flight");
+	}
+
+	// Skip IDs still waiting for a reply
+	while (m_pending.count(m_next_id)) {
+		m_next_id++;
+	}
+	id = m_next_id++;
+
+	frame.push_back(RPC_SYNC);
+	frame.push_back(op);
+	frame.push_back(id);
+	frame.push_back(payload.size());
+	frame.insert(frame.end(), payload.begin(), payload.end());
+	crc = crc16Update(0, frame.data() + 1, frame.size() - 1);
+	frame.push_back(crc);
+	frame.push_back(crc >> 8);
+
+	m_pending[id].on_data = on_data;
+	m_port->queue(frame.data(), frame.size());
+
+	return id;
+}
+
+bool Programmer::poll(int timeout_ms)
+{
+	return m_port->run(timeout_ms, [this](const uint8_t *data, size_t len) {
+		receive(data, len);
+	});
+}
+
+uint8_t Programmer::wait(uint8_t id)
+{
+	auto it = m_pending.find(id);
+	uint8_t status;
+
+	if (it == m_pending.end()) {
+		throw Error("No such request");
+	}
+
+	// The handler may reference the caller's locals, so the request must
+	// not outlive this call if it fails
+	try {
+		while (!it->second.done) {
+			if (!poll(m_timeout)) {
+				throw Error("Timeout waiting for a reply");
+			}
+		}
+	} catch (...) {
+		m_pending.erase(it);
+		throw;
+	}
+
+	status = it->second.status;
+	m_pending.erase(it);
+
+	return status;
+}
+
+void Programmer::call(uint8_t op, const std::vector<uint8_t> &payload, DataHandler on_data)
+{
+	uint8_t status = wait(submit(op, payload, on_data));
+
+	if (status != RPC_STATUS_OK) {
+		throw Error(std::string("Request failed: ") + statusString(status));
+	}
+}
+
+/* Reply frames are assembled in m_rx. Anything before a sync byte
+ * (text, prompt) is skipped. */
+void Programmer::receive(const uint8_t *data, size_t len)
+{
+	for (; len; data++, len--) {
+		if (m_rx.empty() && *data != RPC_REPLY_SYNC)
+			continue;
+
+		m_rx.push_back(*data);
+		if (m_rx.size() >= REPLY_HEADER_SIZE && m_rx.size() == REPLY_HEADER_SIZE + m_rx[4] + 2u) {
+			// Ready for the next frame even if handling this one throws
+			std::vector<uint8_t> frame;
+			frame.swap(m_rx);
+			handleReply(frame);
+		}
+	}
+}
+
+void Programmer::handleReply(const std::vector<uint8_t> &frame)
+{
+	size_t len = frame[4];
+	const uint8_t *payload = frame.data() + REPLY_HEADER_SIZE;
+	uint16_t crc = crc16Update(0, frame.data() + 1, REPLY_HEADER_SIZE - 1 + len);
+	uint8_t status = frame[3];
+
+	if (crc != (payload[len] | (payload[len + 1] << 8))) {
+		throw Error("Bad reply CRC");
+	}
+
+	// Replies to abandoned requests are ignored
+	auto it = m_pending.find(frame[2]);
+	if (it == m_pending.end() || it->second.done)
+		return;
+
+	if (len && it->second.on_data) {
+		it->second.on_data(payload, len);
+	}
+	if (status != RPC_STATUS_MORE) {
+		it->second.done = true;
+		it->second.status = status;
+	}
+}
+
+void Programmer::ping(uint8_t *protocol_version, uint16_t *firmware_version)
+{
+	std::vector<uint8_t> reply;
+
+	call(RPC_OP_PING, {}, [&reply](const uint8_t *data, size_t len) {
+		reply.insert(reply.end(), data, data + len);
+	});
+	if (reply.size() < 3) {
+		throw Error("Short ping reply");
+	}
+
+	*protocol_version = reply[0];
+	*firmware_version = reply[1] | (reply[2] << 8);
+}
+
+std::string Programmer::command(const std::string &line)
+{
+	std::string output;
+
+	if (line.size() > 4 + RPC_MAX_DATA) {
+		throw Error("Command too long");
+	}
+
+	call(RPC_OP_COMMAND, std::vector<uint8_t>(line.begin(), line.end()),
+		[&output](const uint8_t *data, size_t len) {
+			output.append((const char *)data, len);
+		});
+
+	return output;
+}
+
+Info Programmer::info()
+{
+	std::vector<uint8_t> reply;
+	Info info;
+
+	call(RPC_OP_INFO, {}, [&reply](const uint8_t *data, size_t len) {
+		reply.insert(reply.end(), data, data + len);
+	});
+	if (reply.size() < 9) {
+		throw Error("Short info reply");
+	}
+
+	info.rom_size = get32(&reply[0]);
+	info.flash_size = get32(&reply[4]);
+	info.mapper_type = reply[8];
+
+	return info;
+}
+
+void Programmer::eraseSector(uint32_t rom_addr)
+{
+	std::vector<uint8_t> payload;
+
+	put32(payload, rom_addr);
+	call(RPC_OP_ERASE_SECTOR, payload);
+}
+
+void Programmer::dump(int fd, uint32_t rom_addr, uint32_t size, Progress progress)
+{
+	std::deque<uint8_t> ids;
+	std::vector<uint8_t> payload;
+	uint32_t next = rom_addr, end = rom_addr + size, n;
+	uint64_t done = 0;
+	uint8_t status;
+
+	// Replies arrive in order, so the data can go straight to the file
+	DataHandler on_data = [&](const uint8_t *data, size_t len) {
+		writeAll(fd, data, len);
+		done += len;
+		if (progress) {
+			progress(done, size);
+		}
+	};
+
+	try {
+		while (next < end || !ids.empty()) {
+			while (next < end && ids.size() < m_window) {
+				n = std::min<uint32_t>(DUMP_CHUNK, end - next);
+				payload.clear();
+				put32(payload, next);
+				put32(payload, n);
+				ids.push_back(submit(RPC_OP_READ, payload, on_data));
+				next += n;
+			}
+
+			status = wait(ids.front());
+			ids.pop_front();
+			if (status != RPC_STATUS_OK) {
+				throw Error(std::string("Read failed: ") + statusString(status));
+			}
+		}
+	} catch (...) {
+		// on_data goes out of scope
+		for (uint8_t id : ids) {
+			m_pending.erase(id);
+		}
+		throw;
+	}
+}
+
+void Programmer::program(const uint8_t *data, size_t len, Progress progress)
+{
+	std::deque<std::pair<uint8_t, size_t>> ids;
+	std::vector<uint8_t> payload;
+	size_t addr = 0, n;
+	uint8_t status;
+
+	// Tells the programmer where the image ends, so it does not erase
+	// sectors past it ahead of time
+	put32(payload, len);
+	ids.push_back({ submit(RPC_OP_PROGRAM_BEGIN, payload), 0 });
+
+	while (addr < len || !ids.empty()) {
+		while (addr < len && ids.size() < m_window) {
+			n = std::min(RPC_MAX_DATA, len - addr);
+
+			// 0xFF is the erased state. The first block starts the upload
+			// (sector erasing) and the last one is always sent.
+			if (addr && addr + n < len &&
+				std::all_of(data + addr, data + addr + n, [](uint8_t b) { return b == 0xFF; })) {
+				addr += n;
+				continue;
+			}
+
+			payload.clear();
+			put32(payload, addr);
+			payload.insert(payload.end(), data + addr, data + addr + n);
+			ids.push_back({ submit(RPC_OP_PROGRAM, payload), addr + n });
+			addr += n;
+		}
+
+		if (ids.empty())
+			break;
+
+		status = wait(ids.front().first);
+		if (status != RPC_STATUS_OK) {
+			for (auto &p : ids) {
+				m_pending.erase(p.first);
+			}
+			throw Error(std::string("Programming failed: ") + statusString(status));
+		}
+		if (progress) {
+			progress(ids.front().second, len);
+		}
+		ids.pop_front();
+	}
+}
+
+} // namespace smscprogr
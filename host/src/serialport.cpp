@@ -0,0 +1,161 @@
+/*	smsprogr : Programmer for SMS and GG cartridges.
+ *	Copyright (C) 2020-2021  Raphael Assenat <raph@raphnet.net>
+ *
+ *	This program is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "serialport.h"
+#include "smscprogr/programmer.h"
+
+namespace smscprogr {
+
+// Received data is read in blocks of this size
+#define RX_BLOCK	4096
+
+static std::string errnoString(const std::string &what)
+{
+	return what + ": " + strerror(errno);
+}
+
+SerialPort::SerialPort(const std::string &device)
+{
+	struct termios tio;
+	struct epoll_event ev = {};
+
+	m_fd = open(device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (m_fd < 0) {
+		throw Error(errnoString(device));
+	}
+
+	// Raw mode. The speed does not matter (USB CDC-ACM).
+	if (tcgetattr(m_fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		cfsetspeed(&tio, B115200);
+		tio.c_cc[VMIN] = 0;
+		tio.c_cc[VTIME] = 0;
+		tcsetattr(m_fd, TCSANOW, &tio);
+		tcflush(m_fd, TCIOFLUSH);
+	}
+
+	m_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epfd < 0) {
+		close(m_fd);
+		throw Error(errnoString("epoll_create1"));
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = m_fd;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_fd, &ev) < 0) {
+		close(m_epfd);
+		close(m_fd);
+		throw Error(errnoString("epoll_ctl"));
+	}
+}
+
+SerialPort::~SerialPort()
+{
+	close(m_epfd);
+	close(m_fd);
+}
+
+void SerialPort::queue(const uint8_t *data, size_t len)
+{
+	// Drop what was already sent before growing the buffer
+	if (m_txpos == m_tx.size()) {
+		m_tx.clear();
+		m_txpos = 0;
+	}
+	m_tx.insert(m_tx.end(), data, data + len);
+}
+
+void SerialPort::flush()
+{
+	ssize_t n;
+
+	while (txPending()) {
+		n = write(m_fd, m_tx.data() + m_txpos, m_tx.size() - m_txpos);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			throw Error(errnoString("write"));
+		}
+		m_txpos += n;
+	}
+}
+
+/* Only ask for EPOLLOUT while there is something to send */
+void SerialPort::updateEvents()
+{
+	struct epoll_event ev = {};
+
+	if (m_want_out == txPending())
+		return;
+
+	m_want_out = txPending();
+	ev.events = EPOLLIN | (m_want_out ? (uint32_t)EPOLLOUT : 0);
+	ev.data.fd = m_fd;
+	if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, m_fd, &ev) < 0) {
+		throw Error(errnoString("epoll_ctl"));
+	}
+}
+
+bool SerialPort::run(int timeout_ms, const RxHandler &on_rx)
+{
+	struct epoll_event ev;
+	uint8_t buf[RX_BLOCK];
+	ssize_t n;
+	int res;
+
+	flush();
+	updateEvents();
+
+	res = epoll_wait(m_epfd, &ev, 1, timeout_ms);
+	if (res < 0) {
+		if (errno == EINTR)
+			return true;
+		throw Error(errnoString("epoll_wait"));
+	}
+	if (res == 0) {
+		return false;
+	}
+
+	if (ev.events & (EPOLLERR | EPOLLHUP)) {
+		throw Error("Serial port disconnected");
+	}
+
+	if (ev.events & EPOLLOUT) {
+		flush();
+	}
+
+	if (ev.events & EPOLLIN) {
+		while ((n = read(m_fd, buf, sizeof(buf))) > 0) {
+			on_rx(buf, n);
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			throw Error(errnoString("read"));
+		}
+	}
+
+	return true;
+}
+
+} // namespace smscprogr
@@ -0,0 +1,46 @@
+#ifndef _serialport_h__
+#define _serialport_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace smscprogr {
+
+/* Non-blocking tty in raw mode, driven by epoll. Data to send is queued
+ * and written as the tty accepts it, received data is read in large
+ * blocks and given to a callback. */
+class SerialPort {
+public:
+	using RxHandler = std::function<void(const uint8_t *data, size_t len)>;
+
+	// Throws Error if the device cannot be opened
+	explicit SerialPort(const std::string &device);
+	~SerialPort();
+
+	SerialPort(const SerialPort &) = delete;
+	SerialPort &operator=(const SerialPort &) = delete;
+
+	void queue(const uint8_t *data, size_t len);
+	bool txPending() const { return m_txpos < m_tx.size(); }
+
+	/* Wait up to timeout_ms for the tty to become readable (or writable
+	 * while data is queued), then do the I/O. Returns false on timeout. */
+	bool run(int timeout_ms, const RxHandler &on_rx);
+
+private:
+	void flush();
+	void updateEvents();
+
+	int m_fd = -1;
+	int m_epfd = -1;
+	bool m_want_out = false;
+	std::vector<uint8_t> m_tx;
+	size_t m_txpos = 0;
+};
+
+} // namespace smscprogr
+
+#endif // _serialport_h__